@@ -0,0 +1,230 @@
+// Microbenchmarks for the sample and render paths of every metric, plus
+// one full tick of the status loop.  /proc and /sys are read from the
+// snapshot under FIXTURE_ROOT (bench/fixtures for `make bench') so numbers
+// are comparable across machines; Net and Wifi still talk to the live
+// kernel and wpa_supplicant, and ALSA is only touched with -a since the
+// numbers depend on the sound server behind the mixer.
+//
+//   ./dwmstatus-bench [-a] [-n ITERATIONS] [FIXTURE_ROOT]
+
+#define DWMSTATUS_NO_MAIN
+#include "../dwmstatus.cpp"
+
+#include <new>
+
+static size_t allocations;
+
+// gcc can't tell that these new/delete replacements match each other.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(size_t n) {
+  ++allocations;
+  if (void *p = malloc(n)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// Keeps the compiler from throwing away what we render.
+static volatile size_t sink;
+
+class Bench {
+  const int _iterations;
+  char _buf[1<<14];
+  Writer _w;
+
+public:
+  Bench(int iterations) : _iterations(iterations), _w(_buf, sizeof _buf) {
+    printf("%-22s %12s %12s\n", "", "ns/op", "allocs/op");
+  }
+
+  Writer &writer() {
+    _w.clear();
+    return _w;
+  }
+
+  // Runs f once to reach steady state, then times it and counts its heap
+  // allocations over the configured number of iterations.
+  template<class F>
+  void run(const char *name, F f) {
+    f();
+    const size_t allocs = allocations;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < _iterations; ++i) {
+      f();
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    printf("%-22s %12.0f %12.2f\n", name, ns / _iterations,
+           double(allocations - allocs) / _iterations);
+    sink = sink + _w.size();
+  }
+};
+
+int main(int argc, char **argv) {
+  bool alsa = false;
+  int iterations = 10000;
+  int c;
+  while ((c = getopt(argc, argv, "an:")) != -1) {
+    switch (c) {
+    case 'a':
+      alsa = true;
+      break;
+    case 'n':
+      iterations = std::max(1, atoi(optarg));
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-a] [-n ITERATIONS] [FIXTURE_ROOT]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (optind < argc) {
+    sysroot() = argv[optind];
+  }
+
+  const uint64_t start_ns = monotonic_ns();
+  Bench b(iterations);
+
+  b.run("Load sample", []() { Load l; });
+  b.run("Load render", [&]() { b.writer() << Load(); });
+
+  Cpuinfo cpuinfo;
+  b.run("Cpuinfo sample", [&]() { cpuinfo.sample(); });
+  b.run("Cpuinfo render", [&]() { b.writer() << cpuinfo; });
+  {
+    Cpuinfo grouped;
+    grouped.group(Cpuinfo::NUMA);
+    b.run("Cpuinfo sample (numa)", [&]() { grouped.sample(); });
+    grouped.group(Cpuinfo::PERCENTILES);
+    b.run("Cpuinfo sample (pct)", [&]() { grouped.sample(); });
+    b.run("Cpuinfo render (pct)", [&]() { b.writer() << grouped; });
+  }
+
+  Top top;
+  b.run("Top sample", [&]() { top.sample(); });
+  b.run("Top render", [&]() { b.writer() << top; });
+
+  Meminfo m;
+  b.run("Meminfo sample", [&]() { m.sample(); });
+  b.run("Meminfo render", [&]() { b.writer() << m; });
+
+  Pressure psi;
+  b.run("Pressure sample", [&]() { psi.sample(); });
+  b.run("Pressure render", [&]() { b.writer() << psi; });
+
+  Disk disk;
+  b.run("Disk sample", [&]() { disk.sample(); });
+  b.run("Disk render", [&]() { b.writer() << disk; });
+
+  Temp t;
+  b.run("Temp discover", []() { Temp discovered; });
+  b.run("Temp sample", [&]() { t.sample(); });
+  b.run("Temp render", [&]() { b.writer() << t; });
+
+  Battery bat;
+  b.run("Battery discover", [&]() { bat.discover(); });
+  b.run("Battery sample", [&]() { bat.sample(); });
+  b.run("Battery render", [&]() { b.writer() << bat; });
+
+  Net n;
+  b.run("Net sample", [&]() { n.sample(); });
+  b.run("Net render", [&]() { b.writer() << n; });
+
+  // 512 agents sending over loopback, 64 snapshots a round, and the
+  // summary of them.
+  Cluster cluster;
+  cluster.listen("127.0.0.1:0");
+  {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof sa;
+    getsockname(cluster.fd(), (struct sockaddr *) &sa, &len);
+    const int agent = udp_socket("127.0.0.1:" + std::to_string(ntohs(sa.sin_port)), false);
+    struct dwmstatus_node p;
+    memset(&p, 0, sizeof p);
+    p.magic = htonl(DWMSTATUS_NODE_MAGIC);
+    p.version = htons(DWMSTATUS_NODE_VERSION);
+    p.interval = htons(5);
+    int k = 0;
+    b.run("Cluster receive x64", [&]() {
+        for (int i = 0; i < 64; ++i, ++k) {
+          snprintf(p.host, sizeof p.host, "node%03d", k % 512);
+          p.cpu = uint8_t(k * 7 % 101);
+          send(agent, &p, sizeof p, 0);
+        }
+        cluster.handle_events();
+      });
+    close(agent);
+  }
+  b.run("Cluster sample", [&]() { cluster.sample(); });
+  b.run("Cluster render", [&]() { b.writer() << cluster; });
+
+  EventLoop loop;
+  Wifi w(loop, []() { return true; });
+  b.run("Wifi discover", [&]() { w.discover(); });
+  b.run("Wifi render", [&]() { b.writer() << Wifi::WifiMetric(w.snapshot()); });
+
+  std::unique_ptr<AlsaManager> alsa_manager;
+  if (alsa) {
+    alsa_manager.reset(new AlsaManager);
+    if (!alsa_manager->ok()) {
+      errx(1, "no ALSA mixer");
+    }
+    b.run("Alsa get_volume", [&]() { b.writer() << alsa_manager->get_volume(); });
+  }
+
+  b.run("Datetime render", [&]() { b.writer() << Datetime(); });
+
+  // The same status line as the series and stacks of dwmstatus-bars.h.
+  config().compact_bars = true;
+  b.run("Cpuinfo (compact)", [&]() { b.writer() << cpuinfo; });
+  b.run("Meminfo (compact)", [&]() { b.writer() << m; });
+  b.run("Net (compact)", [&]() { b.writer() << n; });
+  config().compact_bars = false;
+
+  // Everything main() does on a wakeup where every source is due, with a
+  // NullSink in place of the X server.
+  typedef Wifi::WifiMetric WifiMetric;
+  typedef AlsaManager::AlsaMetric AlsaMetric;
+  StatusLayout<Cpuinfo, Top, Meminfo, Pressure, Disk, Net, Temp, WifiMetric, Battery, AlsaMetric,
+               Cluster, Datetime> status;
+  Sparkline<30> cpu_trend, mem_trend;
+  NullSink null_sink;
+  b.run("tick", [&]() {
+      status.get<Cpuinfo>().sample();
+      cpu_trend.push(status.get<Cpuinfo>().pct(0), status.get<Cpuinfo>().color_for(0));
+      status.update<Cpuinfo>(' ', cpu_trend);
+      status.get<Top>().sample();
+      status.update<Top>();
+      status.get<Meminfo>().sample();
+      mem_trend.push(status.get<Meminfo>().pct(), status.get<Meminfo>().color());
+      status.update<Meminfo>(' ', mem_trend);
+      status.get<Pressure>().sample();
+      status.update<Pressure>();
+      status.get<Disk>().sample();
+      status.update<Disk>();
+      status.get<Net>().sample();
+      status.update<Net>();
+      status.get<Temp>().sample();
+      status.update<Temp>();
+      status.get<WifiMetric>() = WifiMetric(w.snapshot());
+      w.present() ? status.update<WifiMetric>() : status.clear<WifiMetric>();
+      status.get<Battery>().sample();
+      status.get<Battery>().present() ? status.update<Battery>() : status.clear<Battery>();
+      if (alsa_manager) {
+        status.get<AlsaMetric>() = alsa_manager->get_volume();
+        status.update<AlsaMetric>();
+      }
+      status.update<Datetime>();
+      if (status.assemble()) {
+        null_sink.show(status.c_str());
+      }
+      sink = sink + strlen(status.c_str());
+    });
+
+  printf("\n");
+  report(stdout, status, start_ns);
+
+  return 0;
+}
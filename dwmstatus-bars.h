@@ -0,0 +1,123 @@
+// The graphics dwmstatus mixes into the status text it sets as the root
+// window's WM_NAME, and a decoder for dwm's drawbar().  C and C++.
+//
+// Bytes 1-8 switch the text after them to that color scheme, and a byte
+// with the high bit set starts one of
+//
+//   bar     [0x80|filled<<6|color] x y w h skip
+//   series  [0xa1] n y w step flags, then n columns [0x80|(color-1)<<4|h]
+//   stack   [0xa2] n y h frame skip, then n parts [0x80|color] w
+//
+// where every field but a column or a part's color is stored plus one,
+// so that none is NUL.  Coordinates are relative to the pen, which moves
+// right by skip after a bar or stack and by n * step after a series.
+//
+// Column i of a series is w wide at x = i * step and h high, ending on
+// row y, or starting there with DWMSTATUS_SERIES_DOWN.  A series with
+// DWMSTATUS_SERIES_KEEP leaves the pen where it was, for the next series
+// to draw into the same columns.  A stack's parts are filled left to
+// right from x = 0, followed by an outline frame wide in color 1 unless
+// frame is 0.
+//
+// Series and stacks are only sent with `bars = compact' in the config;
+// a drawbar() that knows only bars takes the rest for garbage.
+//
+//   while (*p) {
+//     if (*p & 0x80) {
+//       x += dwmstatus_bars_decode(&p, drawrect, &x);
+//     } else ...
+//   }
+
+#ifndef DWMSTATUS_BARS_H
+#define DWMSTATUS_BARS_H
+
+#define DWMSTATUS_BAR_FILLED 0x40
+#define DWMSTATUS_BAR_OPCODE 0x20  // a series or a stack, not a bar
+#define DWMSTATUS_BAR_SERIES 1
+#define DWMSTATUS_BAR_STACK 2
+
+#define DWMSTATUS_SERIES_DOWN 1
+#define DWMSTATUS_SERIES_KEEP 2
+
+// Bytes in a bar, and before the columns of a series or parts of a stack.
+#define DWMSTATUS_BAR_HEADER 6
+
+struct dwmstatus_rect {
+  int x, y, w, h;  // relative to the pen
+  int filled;
+  int color;       // 1-8, as for text
+};
+
+// Calls rect(ctx, r) for each rectangle of the bar, series or stack at
+// *p, which must point at a byte with the high bit set, and moves *p past
+// it.  Returns how far the pen moves.  rect may be NULL to skip over it;
+// anything cut short by the end of the string ends there.
+static inline int dwmstatus_bars_decode(const char **p,
+                                        void (*rect)(void *, const struct dwmstatus_rect *),
+                                        void *ctx) {
+  const unsigned char *s = (const unsigned char *) *p;
+  struct dwmstatus_rect r;
+  int f[DWMSTATUS_BAR_HEADER];
+  int k, skip = 0;
+  for (k = 0; k < DWMSTATUS_BAR_HEADER; ++k) {
+    if (!s[k]) {
+      *p = (const char *) (s + k);
+      return 0;
+    }
+    f[k] = k ? s[k] - 1 : s[k];
+  }
+  s += DWMSTATUS_BAR_HEADER;
+  if (!(f[0] & DWMSTATUS_BAR_OPCODE)) {
+    r.x = f[1];
+    r.y = f[2];
+    r.w = f[3];
+    r.h = f[4];
+    r.filled = (f[0] & DWMSTATUS_BAR_FILLED) != 0;
+    r.color = f[0] & 0x0f;
+    if (rect) {
+      rect(ctx, &r);
+    }
+    skip = f[5];
+  } else if ((f[0] & 0x0f) == DWMSTATUS_BAR_SERIES) {
+    const int n = f[1], y = f[2], w = f[3], step = f[4], flags = f[5];
+    for (k = 0; k < n && s[k]; ++k) {
+      r.h = s[k] & 0x0f;
+      r.x = k * step;
+      r.y = (flags & DWMSTATUS_SERIES_DOWN) ? y : y - r.h + 1;
+      r.w = w;
+      r.filled = 1;
+      r.color = ((s[k] >> 4) & 7) + 1;
+      if (rect) {
+        rect(ctx, &r);
+      }
+    }
+    s += k;
+    skip = (flags & DWMSTATUS_SERIES_KEEP) ? 0 : n * step;
+  } else if ((f[0] & 0x0f) == DWMSTATUS_BAR_STACK) {
+    const int n = f[1], frame = f[4];
+    r.x = 0;
+    r.y = f[2];
+    r.h = f[3];
+    r.filled = 1;
+    for (k = 0; k < n && s[0] && s[1]; ++k, s += 2) {
+      r.w = s[1] - 1;
+      r.color = s[0] & 0x0f;
+      if (rect) {
+        rect(ctx, &r);
+      }
+      r.x += r.w;
+    }
+    if (frame && rect) {
+      r.x = 0;
+      r.w = frame;
+      r.filled = 0;
+      r.color = 1;
+      rect(ctx, &r);
+    }
+    skip = f[5];
+  }
+  *p = (const char *) s;
+  return skip;
+}
+
+#endif  // DWMSTATUS_BARS_H
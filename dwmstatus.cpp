@@ -24,29 +24,65 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
-#include <fstream>
-#include <iomanip>
-#include <ios>
-#include <iostream>
+#include <cmath>
+#include <functional>
+#include <future>
+#include <map>
+#include <initializer_list>
 #include <memory>
-#include <numeric>
-#include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <limits.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 #include <time.h>
 #include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <alsa/asoundlib.h>
 
 #include "hostap/src/common/wpa_ctrl.h"
 
+#include "dwmstatus.h"
+#include "dwmstatus-bars.h"
+
 static int getncpu(void) {
   int r;
   if ((r = sysconf(_SC_NPROCESSORS_ONLN)) < 0) {
@@ -55,311 +91,369 @@ static int getncpu(void) {
   return r;
 }
 
-enum Color {
-  NORMAL = 1,
-  SELECTED,
-  RED,
-  ORANGE,
-  YELLOW,
-  BLUE,
-  CYAN,
-  GREEN
-};
+// Prefix for every /proc and /sys path we open, so a snapshot of those
+// trees can stand in for the real thing.  Empty means the live system.
+static std::string &sysroot() {
+  static std::string root;
+  return root;
+}
 
-class Metric {
-protected:
-  template<class stream>
-  class ColorScope {
-    stream &_s;
-    Color _c;
-  public:
-    ColorScope(stream &s, enum Color c) : _s(s), _c(c) {
-      if (_c != NORMAL) {
-        _s << (char) _c;
-      }
-    }
-    ~ColorScope() {
-      if (_c != NORMAL) {
-        _s << '\x01';
-      }
-    }
+static uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// --record and --replay: a log of every raw buffer the collectors read
+// (files under /proc and /sys, netlink counters, the wpa_supplicant and
+// ALSA snapshots), and markers saying when each metric sampled.  Each
+// record is a timestamp, the lengths of a name and a payload, and then the
+// name and payload bytes.  Replaying feeds the buffers back in the same
+// order, so the collectors run unchanged and as fast as they can, and with
+// now() keeping the recorded time so that rates come out as they did.
+class Trace {
+  static const uint64_t MAGIC = 0x3143525453574444ull;  // "DDWSTRC1"
+
+  // A payload length for sources that couldn't be read.
+  static const uint32_t MISSING = 0xffffffff;
+
+  FILE *_f;
+  std::vector<char> _log;
+  size_t _pos;
+  std::map<std::string, std::pair<const char *, size_t>> _latest;
+  std::string _marked;
+  uint64_t _now;        // when the record last replayed was written
+  int64_t _realtime;    // CLOCK_REALTIME - CLOCK_MONOTONIC, 0 if unknown
+
+  struct Header {
+    uint64_t t;
+    uint32_t namelen, len;
   };
 
-public:
-  virtual enum Color color() const = 0;
-  virtual operator std::string() const = 0;
-  template<class stream>
-  friend stream &operator<<(stream &s, const Metric &metric) {
-    if (metric.color() != NORMAL) {
-      ColorScope<stream> cs(s, metric.color());
-      s << (std::string) metric;
+  // The record at _pos, or false at the end of the log.
+  bool _peek(Header &h, const char *&name, const char *&data) const {
+    if (_pos + sizeof h > _log.size()) {
+      return false;
+    }
+    memcpy(&h, &_log[_pos], sizeof h);
+    if (_pos + sizeof h + h.namelen > _log.size()) {
+      return false;
+    }
+    if (h.len == MISSING) {
+      h.len = 0;
+      data = nullptr;
+    } else if (_pos + sizeof h + h.namelen + h.len > _log.size()) {
+      return false;
     } else {
-      s << (std::string) metric;
+      data = &_log[_pos + sizeof h + h.namelen];
     }
-    return s;
+    name = &_log[_pos + sizeof h];
+    return true;
   }
-};
 
-class Separator : public Metric {
-public:
-  enum Color color() const { return NORMAL; }
-  operator std::string() const { return "::"; }
-};
+  Trace() : _f(nullptr), _pos(0), _now(0), _realtime(0) {}
 
-class Bar : public Metric {
-  const int _x, _y, _w, _h, _skip;
-  const bool _filled;
-  const Color _c;
 public:
-  Bar(int x, int y, int w, int h, int skip, bool filled, Color c)
-    : _x(x),
-      _y(y),
-      _w(w),
-      _h(h),
-      _skip(skip),
-      _filled(filled),
-      _c(c)
-  {}
-  Color color() const { return NORMAL; }
-  operator std::string() const {
-    char buf[6];
-    buf[0] = (char) _c;
-    buf[0] |= 1<<7;
-    if (_filled) {
-      buf[0] |= 1<<6;
+  ~Trace() {
+    if (_f) {
+      fclose(_f);
     }
-    buf[1] = (char) _x + 1;
-    buf[2] = (char) _y + 1;
-    buf[3] = (char) _w + 1;
-    buf[4] = (char) _h + 1;
-    buf[5] = (char) _skip + 1;
-    return std::string(buf, sizeof buf);
   }
-};
+  Trace(const Trace &) = delete;
+  Trace &operator=(const Trace &) = delete;
 
-class Load : public Metric {
-  double one, five, fifteen;
-public:
-  Load() {
-    std::ifstream f("/proc/loadavg");
-    f >> one >> five >> fifteen;
-  }
-  enum Color color() const {
-    static int ncpu = getncpu();
-    return ((one>2*ncpu)
-            ? RED
-            : ((one>3*ncpu/2)
-               ? ORANGE
-               : ((one>ncpu)
-                  ? YELLOW
-                  : BLUE)));
-  }
-  operator std::string() const {
-    std::stringstream ss;
-    ss << std::setw(4) << std::setfill('0') << std::setprecision(2) << std::fixed;
-    ss << one << " " << five << " " << fifteen;
-    return ss.str();
+  // The trace in effect, if any.
+  static std::unique_ptr<Trace> &current() {
+    static std::unique_ptr<Trace> t;
+    return t;
   }
-};
 
-class Cpuinfo : public Metric {
-  static int nelts;
-  static std::unique_ptr<size_t[]> total_last, user_last, sys_last, io_last;
-
-  std::unique_ptr<size_t[]> total_cur, user_cur, sys_cur, io_cur;
-
-public:
-  Cpuinfo() {
-    if (!nelts) {
-      nelts = getncpu() + 1;
-      total_last = std::make_unique<size_t[]>(nelts);
-      user_last = std::make_unique<size_t[]>(nelts);
-      sys_last = std::make_unique<size_t[]>(nelts);
-      io_last = std::make_unique<size_t[]>(nelts);
-      std::fill(&total_last[0], &total_last[nelts], 0);
-      std::fill(&user_last[0], &user_last[nelts], 0);
-      std::fill(&sys_last[0], &sys_last[nelts], 0);
-      std::fill(&io_last[0], &io_last[nelts], 0);
-    }
-
-    total_cur = std::make_unique<size_t[]>(nelts);
-    user_cur = std::make_unique<size_t[]>(nelts);
-    sys_cur = std::make_unique<size_t[]>(nelts);
-    io_cur = std::make_unique<size_t[]>(nelts);
-    std::fill(&total_cur[0], &total_cur[nelts], 0);
-    std::fill(&user_cur[0], &user_cur[nelts], 0);
-    std::fill(&sys_cur[0], &sys_cur[nelts], 0);
-    std::fill(&io_cur[0], &io_cur[nelts], 0);
-    
-    std::ifstream f("/proc/stat");
-    for (int i = 0; i < nelts; ++i) {
-      f.ignore(std::numeric_limits<std::streamsize>::max(), ' ');
-      for (int j = 0; f.good(); ++j) {
-        size_t jiffies;
-        f >> jiffies;
-        if (f.fail()) {
-          f.clear();
-          break;
-        }
-        if (j < 2) {
-          user_cur[i] += jiffies;
-        } else if (j == 2) {
-          sys_cur[i] += jiffies;
-        } else if (j == 4) {
-          io_cur[i] += jiffies;
-        }
-        total_cur[i] += jiffies;
-      }
+  static void record(const char *path) {
+    std::unique_ptr<Trace> t(new Trace);
+    if (!(t->_f = fopen(path, "wb"))) {
+      err(1, "fopen(%s)", path);
     }
+    const uint64_t magic = MAGIC;
+    fwrite(&magic, sizeof magic, 1, t->_f);
+    current() = std::move(t);
+    // For the clock a replay shows.
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const int64_t realtime = int64_t(uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec - monotonic_ns());
+    write("clock", &realtime, sizeof realtime);
   }
-  ~Cpuinfo() {
-    std::copy(&total_cur[0], &total_cur[nelts], &total_last[0]);
-    std::copy(&user_cur[0], &user_cur[nelts], &user_last[0]);
-    std::copy(&sys_cur[0], &sys_cur[nelts], &sys_last[0]);
-    std::copy(&io_cur[0], &io_cur[nelts], &io_last[0]);
-  }
-  int pct(int i) const {
-    return int(100 * double(user_cur[i] - user_last[i] + sys_cur[i] - sys_last[i]) / double(total_cur[i] - total_last[i]));
+
+  // Loads the whole log, and makes the first buffer under each name
+  // visible right away so collectors can be constructed from it.
+  static void replay(const char *path) {
+    std::unique_ptr<Trace> t(new Trace);
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+      err(1, "fopen(%s)", path);
+    }
+    char buf[1<<16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof buf, f)) > 0) {
+      t->_log.insert(t->_log.end(), buf, buf + n);
+    }
+    fclose(f);
+    uint64_t magic = 0;
+    if (t->_log.size() < sizeof magic ||
+        (memcpy(&magic, t->_log.data(), sizeof magic), magic != MAGIC)) {
+      errx(1, "%s: not a dwmstatus trace", path);
+    }
+    t->_pos = sizeof magic;
+    Header h;
+    const char *name, *data;
+    if (t->_peek(h, name, data)) {
+      t->_now = h.t;
+    }
+    while (t->_peek(h, name, data)) {
+      t->_latest.insert(std::make_pair(std::string(name, h.namelen), std::make_pair(data, size_t(h.len))));
+      t->_pos += sizeof h + h.namelen + h.len;
+    }
+    t->_pos = sizeof magic;
+    current() = std::move(t);
+    size_t len;
+    if (get("clock", data, len) && len == sizeof current()->_realtime) {
+      memcpy(&current()->_realtime, data, len);
+    }
   }
-  int user(int i) const {
-    return int(100 * double(user_cur[i] - user_last[i]) / double(total_cur[i] - total_last[i]));
+
+  static bool recording() { return current() && current()->_f; }
+  static bool replaying() { return current() && !current()->_f; }
+
+  // CLOCK_MONOTONIC ns to take rates over: in a replay, the time the
+  // record last applied was written.
+  static uint64_t now() {
+    return replaying() ? current()->_now : monotonic_ns();
   }
-  int sys(int i) const {
-    return int(100 * double(sys_cur[i] - sys_last[i]) / double(total_cur[i] - total_last[i]));
+
+  // time(), as of now() on the recording machine.  A trace from before
+  // the clock was recorded shows ours.
+  static time_t wall_time() {
+    if (replaying() && current()->_realtime) {
+      return time_t((int64_t(current()->_now) + current()->_realtime) / 1000000000);
+    }
+    return time(NULL);
   }
-  int io(int i) const {
-    return int(100 * double(io_cur[i] - io_last[i]) / double(total_cur[i] - total_last[i]));
+
+  // Appends a record if we're recording.  A null data records that the
+  // source wasn't there.
+  static void write(const std::string &name, const void *data, size_t len) {
+    if (!recording()) {
+      return;
+    }
+    FILE *f = current()->_f;
+    const Header h{monotonic_ns(), uint32_t(name.size()), data ? uint32_t(len) : MISSING};
+    fwrite(&h, sizeof h, 1, f);
+    fwrite(name.data(), 1, name.size(), f);
+    if (data) {
+      fwrite(data, 1, len, f);
+    }
   }
-  enum Color color() const {
-    return NORMAL;
+
+  // Notes that the metric called name just sampled; replay() hands these
+  // back from next().
+  static void mark(const char *name) {
+    if (recording()) {
+      write(std::string("@") + name, "", 0);
+      fflush(current()->_f);
+    }
   }
-  enum Color color_for(int i) const {
-    const int p = pct(i);
-    return ((p > 90)
-            ? RED
-            : ((p > 75)
-               ? ORANGE
-               : ((p > 50)
-                  ? YELLOW
-                  : ((p > 10)
-                     ? GREEN
-                     : BLUE))));
+
+  // The latest buffer replayed under name.
+  static bool get(const std::string &name, const char *&data, size_t &len) {
+    const auto &latest = current()->_latest;
+    auto it = latest.find(name);
+    if (it == latest.end() || !it->second.first) {
+      return false;
+    }
+    data = it->second.first;
+    len = it->second.second;
+    return true;
   }
-  operator std::string() const {
-    std::stringstream ss;
-    {
-      ColorScope<std::stringstream> cs(ss, color_for(0));
-      ss << user(0) << "% "
-         << sys(0) << "% "
-         << io(0) << "%";
+
+  // Applies records up to the next marker, and returns the name of the
+  // metric it marks.  Returns nullptr at the end of the log.
+  const char *next() {
+    Header h;
+    const char *name, *data;
+    while (_peek(h, name, data)) {
+      _pos += sizeof h + h.namelen + h.len;
+      _now = h.t;
+      if (h.namelen && name[0] == '@') {
+        _marked.assign(name + 1, h.namelen - 1);
+        return _marked.c_str();
+      }
+      _latest[std::string(name, h.namelen)] = std::make_pair(data, size_t(h.len));
     }
-    for (int i = 1; i < nelts; ++i) {
-      ss << Bar(0,
-                2 + (i - 1) * 3,
-                40 * user(i) / 100,
-                2,
-                0,
-                true,
-                BLUE);
-      ss << Bar(40 * user(i) / 100,
-                2 + (i - 1) * 3,
-                40 * sys(i) / 100,
-                2,
-                0,
-                true,
-                YELLOW);
-      ss << Bar(40 * user(i) / 100 + 40 * sys(i) / 100,
-                2 + (i - 1) * 3,
-                40 * io(i) / 100,
-                2,
-                (i == (nelts - 1)) ? 41 : 0,
-                true,
-                RED);
-    }
-    return ss.str();
-  }
-};
-int Cpuinfo::nelts = 0;
-std::unique_ptr<size_t[]> Cpuinfo::total_last = nullptr;
-std::unique_ptr<size_t[]> Cpuinfo::user_last = nullptr;
-std::unique_ptr<size_t[]> Cpuinfo::sys_last = nullptr;
-std::unique_ptr<size_t[]> Cpuinfo::io_last = nullptr;
+    return nullptr;
+  }
 
-class Meminfo : public Metric {
-  size_t total, mfree, buff, cach;
-public:
-  Meminfo() {
-    std::ifstream f("/proc/meminfo");
-    int got = 0;
-    while (!f.eof()) {
-      char buf[256];
-      f.getline(buf, 256);
-      if (sscanf(buf, "MemTotal: %zu kB", &total) == 1 ||
-          sscanf(buf, "MemFree: %zu kB", &mfree) == 1 ||
-          sscanf(buf, "Buffers: %zu kB", &buff) == 1 ||
-          sscanf(buf, "Cached: %zu kB", &cach) == 1) {
-        if (++got == 4) {
-          break;
-        }
+  // Names of the entries directly under dir that anything in the log
+  // lives in, standing in for readdir() on the machine it was recorded on.
+  static std::vector<std::string> entries(const std::string &dir) {
+    std::vector<std::string> ret;
+    const std::string prefix = dir + "/";
+    const auto &latest = current()->_latest;
+    for (auto it = latest.lower_bound(prefix);
+         it != latest.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+      const std::string name = it->first.substr(prefix.size(), it->first.find('/', prefix.size()) - prefix.size());
+      if (ret.empty() || ret.back() != name) {
+        ret.push_back(name);
       }
     }
+    return ret;
   }
-  enum Color color() const {
-    return (((mfree+cach)*10<total)
-            ? RED
-            : (((mfree+cach)*5<total)
-               ? ORANGE
-               : (((mfree+cach)*3<total)
-                  ? YELLOW
-                  : GREEN)));
+};
+
+// A /proc or /sys file that is opened once and re-read from offset 0 on
+// every sample, so a tick costs one pread() instead of open/read/close and a
+// fresh stream buffer.  If the file can't be opened (a battery that isn't
+// plugged in, say) we try again on the next read().
+class File {
+  const std::string _name, _path;
+  int _fd;
+  std::vector<char> _buf;
+  size_t _len;
+
+  void _open() {
+    _fd = open(_path.c_str(), O_RDONLY | O_CLOEXEC);
   }
-  operator std::string() const {
-    const size_t used = (total - buff - cach - mfree);
-    std::stringstream ss;
-    ss << std::setw(1) << std::setfill('0') << std::setprecision(1) << std::fixed;
-    ss << "u " << (used > (1<<20) ? (used / 1024.0 / 1024.0) : (used / 1024.0)) << (used > (1<<20) ? "G " : "M ")
-       << "b " << (buff > (1<<20) ? (buff / 1024.0 / 1024.0) : (buff / 1024.0)) << (buff > (1<<20) ? "G " : "M ")
-       << "c " << (cach > (1<<20) ? (cach / 1024.0 / 1024.0) : (cach / 1024.0)) << (cach > (1<<20) ? "G " : "M ");
-    int x = 0;
-    ss << Bar(x, 1, 100 * used / total, 12, 0, true, GREEN); x += 100 * used / total;
-    ss << Bar(x, 1, 100 * buff / total, 12, 0, true, BLUE);  x += 100 * buff / total;
-    ss << Bar(x, 1, 100 * cach / total, 12, 0, true, ORANGE);
-    ss << Bar(0, 1, 100, 12, 101, false, NORMAL);
-    return ss.str();
+
+  void _close() {
+    if (_fd >= 0) {
+      close(_fd);
+      _fd = -1;
+    }
+  }
+
+  bool _replay() {
+    const char *data;
+    size_t len;
+    if (!Trace::get(_name, data, len)) {
+      return false;
+    }
+    if (len + 1 > _buf.size()) {
+      _buf.resize(len + 1);
+    }
+    memcpy(&_buf[0], data, len);
+    _len = len;
+    _buf[_len] = '\0';
+    return true;
   }
-};
 
-class Temp : public Metric {
-  double temp;
 public:
-  Temp() : temp(0) {
-    for (int i = 0; i < 2; ++i) {
-      std::stringstream ss;
-      ss << "/sys/class/thermal/thermal_zone" << i << "/temp";
-      std::ifstream f(ss.str());
-      double ti;
-      f >> ti;
-      temp += ti / 2000.0;
+  File(const std::string &path, size_t bufsz = 4096)
+    : _name(path),
+      _path(sysroot() + path),
+      _fd(-1),
+      _buf(bufsz),
+      _len(0) {
+    if (!Trace::replaying()) {
+      _open();
     }
+    _buf[0] = '\0';
   }
-  enum Color color() const {
-    return ((temp > 80)
-            ? RED
-            : ((temp > 65)
-               ? ORANGE
-               : ((temp > 50)
-                  ? YELLOW
-                  : GREEN)));
+  ~File() {
+    _close();
   }
-  operator std::string() const {
-    std::stringstream ss;
-    ss << std::setw(1) << std::setfill('0') << std::setprecision(1) << std::fixed;
-    ss << temp << 'C';
-    return ss.str();
+  File(const File &) = delete;
+  File &operator=(const File &) = delete;
+
+  // Reads the whole file into the buffer, growing it if the file has
+  // outgrown it, and NUL-terminates the contents.  Returns false if the file
+  // isn't there.
+  bool read() {
+    _len = 0;
+    _buf[0] = '\0';
+    if (Trace::replaying()) {
+      return _replay();
+    }
+    if (_fd < 0) {
+      _open();
+      if (_fd < 0) {
+        Trace::write(_name, nullptr, 0);
+        return false;
+      }
+    }
+    for (;;) {
+      const size_t want = _buf.size() - _len - 1;
+      ssize_t n = pread(_fd, &_buf[_len], want, _len);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // The device went away underneath us (ENODEV and friends), reopen
+        // next time.
+        _close();
+        _len = 0;
+        _buf[0] = '\0';
+        Trace::write(_name, nullptr, 0);
+        return false;
+      }
+      _len += n;
+      // /proc and /sys hand over all they have at once, so a read that
+      // leaves room in the buffer got to the end.
+      if (size_t(n) < want) {
+        break;
+      }
+      _buf.resize(2 * _buf.size());
+    }
+    _buf[_len] = '\0';
+    Trace::write(_name, data(), _len);
+    return true;
   }
+
+  const char *data() const { return &_buf[0]; }
+  size_t size() const { return _len; }
+  const std::string &path() const { return _path; }
 };
 
+// Returns the start of the line after the one p points into.
+static const char *next_line(const char *p) {
+  const char *nl = strchr(p, '\n');
+  return nl ? nl + 1 : p + strlen(p);
+}
+
+// Whether the keylen bytes at key spell out k, as when matching the key of
+// a "KEY=value" line.
+template<size_t N>
+static inline bool key_is(const char *key, size_t keylen, const char (&k)[N]) {
+  return keylen == N - 1 && strncmp(key, k, keylen) == 0;
+}
+
+// Copies len bytes from src to dst and NUL-terminates it, with '?' in
+// place of anything but printable ASCII: in a status line bytes 1-8
+// switch colors and a high bit starts a bar.
+static void copy_printable(char *dst, const char *src, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    dst[i] = (src[i] >= 0x20 && src[i] <= 0x7e) ? src[i] : '?';
+  }
+  dst[len] = '\0';
+}
+
+// First line of a small sysfs attribute, or "" if it isn't there.
+static std::string read_line(const std::string &path) {
+  File f(path, 256);
+  if (!f.read()) {
+    return "";
+  }
+  return std::string(f.data(), strcspn(f.data(), "\n"));
+}
+
+// In a replay, paths here are taken relative to sysroot() and looked up in
+// the trace.
+static std::string unrooted(const std::string &path) {
+  const std::string &root = sysroot();
+  return path.compare(0, root.size(), root) == 0 ? path.substr(root.size()) : path;
+}
+
 static bool dir_exists(const std::string &filename) {
+  if (Trace::replaying()) {
+    return !Trace::entries(unrooted(filename)).empty();
+  }
   struct stat st;
   int r = stat(filename.c_str(), &st);
   if (r == 0) {
@@ -371,557 +465,4926 @@ static bool dir_exists(const std::string &filename) {
   }
 }
 
-class Battery : public Metric {
-  class SingleBattery {
-  public:
-    ssize_t energy_now, energy_full, power_now;
-    std::string status;
-    bool present;
+class Dir {
+  DIR *_dir;
+  // What a replayed trace says is in the directory.
+  std::vector<std::string> _entries;
+  mutable size_t _i;
 
-    SingleBattery(const std::string &batdir)
-      : energy_now(0),
-        energy_full(0),
-        power_now(0),
-        status(""),
-        present(false) {
-      if (dir_exists(batdir)) {
-        {
-          std::stringstream ss;
-          ss << batdir << "/present";
-          int p;
-          std::ifstream f(ss.str());
-          f >> p;
-          present = p != 0;
-        }
-        if (present) {
-          {
-            std::stringstream ss;
-            ss << batdir << "/energy_now";
-            std::ifstream f(ss.str());
-            f >> energy_now;
-          }
-          {
-            std::stringstream ss;
-            ss << batdir << "/energy_full";
-            std::ifstream f(ss.str());
-            f >> energy_full;
-          }
-          {
-            std::stringstream ss;
-            ss << batdir << "/power_now";
-            std::ifstream f(ss.str());
-            f >> power_now;
-          }
-          {
-            std::stringstream ss;
-            ss << batdir << "/status";
-            std::ifstream f(ss.str());
-            f >> status;
-          }
-        }
-      }
+  const char *_next() const {
+    if (!_dir) {
+      return _i < _entries.size() ? _entries[_i++].c_str() : NULL;
     }
-  };
-
-  int _percent, _minutes;
-  bool _present;
-  char _direction;
+    struct dirent *ent = readdir(_dir);
+    if (ent == NULL) {
+      return NULL;
+    }
+    return ent->d_name;
+  }
 
 public:
-  Battery() : _percent(0), _minutes(0), _present(false), _direction('!') {
-    std::vector<SingleBattery> batteries;
-    for (int i = 0; i < 2; ++i) {
-      std::stringstream ss;
-      ss << "/sys/class/power_supply/BAT" << i;
-      SingleBattery sb(ss.str());
-      if (sb.present) {
-        _present = true;
-        batteries.push_back(sb);
-      }
+  Dir(const char *name) : _dir(nullptr), _i(0) {
+    if (Trace::replaying()) {
+      _entries = Trace::entries(unrooted(name));
+      return;
     }
-
-    ssize_t power = std::accumulate(batteries.begin(), batteries.end(), 0,
-                                    [](ssize_t acc, const SingleBattery &b) {
-                                      if (b.present) {
-                                        return acc + b.power_now;
-                                      } else {
-                                        return acc;
-                                      }
-                                    });
-    ssize_t energy_full = std::accumulate(batteries.begin(), batteries.end(), 0,
-                                          [](ssize_t acc, const SingleBattery &b) {
-                                            if (b.present) {
-                                              return acc + b.energy_full;
-                                            } else {
-                                              return acc;
-                                            }
-                                          });
-    ssize_t energy_now = std::accumulate(batteries.begin(), batteries.end(), 0,
-                                         [](ssize_t acc, const SingleBattery &b) {
-                                           if (b.present) {
-                                             return acc + b.energy_now;
-                                           } else {
-                                             return acc;
-                                           }
-                                         });
-
-    std::ifstream acf("/sys/class/power_supply/AC/online");
-    int ac_present;
-    acf >> ac_present;
-
-    double dpercent = 100.0 * energy_now / energy_full;
-    if (100.0 - dpercent < 0.5) {
-      _percent = 100;
-    } else {
-      _percent = int(dpercent);
+    if ((_dir = opendir(name)) == NULL) {
+      err(1, "opendir");
     }
-    if (ac_present == 1) {
-      if (_percent == 100) {
-        _direction = '=';
-        _minutes = 0;
-      } else {
-        _direction = '+';
-        _minutes = int(60.0 * (energy_full - energy_now) / power);
-      }
-    } else {
-      _direction = '-';
-      _minutes = int(60.0 * energy_now / power);
+  }
+  Dir(const Dir &) = delete;
+  Dir &operator=(const Dir &) = delete;
+  ~Dir() {
+    if (_dir) {
+      closedir(_dir);
     }
-    if (_minutes < 0) {
-      _minutes = 0;
+  }
+
+  const char *next() const {
+    const char *ret;
+    while ((ret = _next()) != NULL && (strcmp(ret, ".") == 0 || strcmp(ret, "..") == 0)) {}
+    return ret;
+  }
+};
+
+// Latencies in power-of-two nanosecond buckets: bucket k counts samples in
+// [2^(k-1), 2^k).  Cheap enough to record into on every sample.  Each
+// histogram has a single writer, but the counters are relaxed atomics so
+// the report can read them from another thread.
+class Histogram {
+  static const int NBUCKETS = 40;
+  std::atomic<uint64_t> _buckets[NBUCKETS];
+  std::atomic<uint64_t> _count, _sum, _max;
+
+  static uint64_t upper(int k) { return uint64_t(1) << k; }
+
+  static void bump(std::atomic<uint64_t> &a, uint64_t n) {
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+public:
+  Histogram() : _count(0), _sum(0), _max(0) {
+    for (auto &b : _buckets) {
+      b.store(0, std::memory_order_relaxed);
     }
   }
 
-  bool present() const { return _present; }
+  void record(uint64_t ns) {
+    const int k = std::min(NBUCKETS - 1, 64 - __builtin_clzll(ns | 1));
+    bump(_buckets[k], 1);
+    bump(_count, 1);
+    bump(_sum, ns);
+    if (ns > _max.load(std::memory_order_relaxed)) {
+      _max.store(ns, std::memory_order_relaxed);
+    }
+  }
 
-  enum Color color() const {
-    return ((_percent < 10
-             ? RED
-             : ((_percent < 20)
-                ? ORANGE
-                : ((_percent < 30)
-                   ? YELLOW
-                   : CYAN))));
+  uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+  uint64_t max() const { return _max.load(std::memory_order_relaxed); }
+  uint64_t mean() const {
+    const uint64_t n = count();
+    return n ? _sum.load(std::memory_order_relaxed) / n : 0;
   }
 
-  operator std::string() const {
-    std::stringstream ss;
-    ss << _direction << _percent << "% ";
-    const int h = std::max(1, std::min(12, int(12 * _percent / 100.0)));
-    ss << Bar(0, 13 - h, 3, h, 3, true, color());
-    if (_percent != 100 || _direction == '-') {
-      ss << std::setw(1) << std::setfill('0') << _minutes / 60 << ":"
-         << std::setw(2) << std::setfill('0') << _minutes % 60;
+  // Upper bound of the bucket holding the pct'th percentile.
+  uint64_t percentile(double pct) const {
+    const uint64_t rank = uint64_t(pct / 100.0 * count());
+    uint64_t seen = 0;
+    for (int k = 0; k < NBUCKETS; ++k) {
+      seen += _buckets[k].load(std::memory_order_relaxed);
+      if (seen > rank) {
+        return std::min(upper(k), max());
+      }
     }
-    return ss.str();
+    return max();
   }
 };
 
-class Datetime : public Metric {
+// Records the time from construction to stop() (or destruction).
+class Stopwatch {
+  Histogram *_h;
+  const uint64_t _start;
 public:
-  enum Color color() const { return NORMAL; }
-  operator std::string() const {
-    char buf[65];
-    time_t result = time(NULL);
-    struct tm *resulttm;
-    if (!(resulttm = localtime(&result))) {
-      err(1, "localtime");
-    }
-    if(!strftime(buf, 64, "%a %b %d %H:%M", resulttm)) {
-      err(1, "strftime");
+  explicit Stopwatch(Histogram &h) : _h(&h), _start(monotonic_ns()) {}
+  ~Stopwatch() {
+    stop();
+  }
+  void stop() {
+    if (_h) {
+      _h->record(monotonic_ns() - _start);
+      _h = nullptr;
     }
-    return buf;
   }
 };
 
-class AlsaManager {
-  class MixerHandle {
-    snd_mixer_t *_h;
-  public:
-    MixerHandle() : _h(nullptr) {
-      if (snd_mixer_open(&_h, 0) != 0) {
-        err(1, "snd_mixer_open");
-      }
+// Fires at the start of every wall-clock minute.  If the clock is stepped
+// (settimeofday, an NTP step, waking from suspend) the kernel cancels the
+// timer, and we treat that as a firing too and align to the new time.
+class MinuteTimer {
+  int _fd;
+public:
+  MinuteTimer() : _fd(timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) {
+    if (_fd < 0) {
+      err(1, "timerfd_create");
     }
-    ~MixerHandle() {
-      snd_mixer_close(_h);
+    arm();
+  }
+  ~MinuteTimer() {
+    close(_fd);
+  }
+  MinuteTimer(const MinuteTimer &) = delete;
+  MinuteTimer &operator=(const MinuteTimer &) = delete;
+
+  int fd() const { return _fd; }
+
+  void arm() const {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct itimerspec its;
+    its.it_interval.tv_sec = 60;
+    its.it_interval.tv_nsec = 0;
+    its.it_value.tv_sec = (now.tv_sec / 60 + 1) * 60;
+    its.it_value.tv_nsec = 0;
+    if (timerfd_settime(_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) != 0) {
+      err(1, "timerfd_settime");
     }
-    snd_mixer_t *get() const { return _h; }
-  };
+  }
 
-  class MixerSelemId {
-    snd_mixer_selem_id_t *_s;
-  public:
-    MixerSelemId(const char *mix_name, int mix_index) : _s(nullptr) {
-      snd_mixer_selem_id_malloc(&_s);
-      snd_mixer_selem_id_set_index(_s, mix_index);
-      snd_mixer_selem_id_set_name(_s, mix_name);
+  // Consumes the pending expirations.  Returns false if nothing was
+  // pending, which happens on a spurious wakeup.
+  bool expired() const {
+    uint64_t n;
+    if (::read(_fd, &n, sizeof n) == sizeof n) {
+      return true;
     }
-    ~MixerSelemId() {
-      snd_mixer_selem_id_free(_s);
+    if (errno == ECANCELED) {
+      // The clock jumped; maybe the timezone changed with it.
+      tzset();
+      arm();
+      return true;
     }
-    snd_mixer_selem_id_t *get() const { return _s; }
-  };
+    return false;
+  }
+};
 
-  class MixerLoader {
-    snd_mixer_t *_handle;
+// A sampling interval that doubles each time a metric reads steady, up to
+// a ceiling, and drops back to the floor as soon as it moves.  While we're
+// running on battery every interval is doubled, ceiling included.
+class Backoff {
+  const std::chrono::milliseconds _min, _max;
+  std::chrono::milliseconds _cur;
+
+public:
+  // Set by the Battery sampler.
+  static bool &on_battery() {
+    static bool b = false;
+    return b;
+  }
+
+  explicit Backoff(std::chrono::milliseconds min,
+                   std::chrono::milliseconds max = std::chrono::seconds(30))
+    : _min(min), _max(std::max(min, max)), _cur(min) {}
+
+  void steady() { _cur = std::min(_max, 2 * _cur); }
+  void moved() { _cur = _min; }
+
+  std::chrono::milliseconds interval() const {
+    return on_battery() ? 2 * _cur : _cur;
+  }
+};
+
+// An epoll set of timers and other event sources.  Each source has a
+// callback that returns true if it refreshed something worth redrawing.
+class EventLoop {
+  typedef std::function<bool()> Callback;
+
+  struct Source {
+    int fd;
+    Callback cb;
+  };
+
+  // Something run on a schedule instead of when an fd is ready.
+  struct Job {
+    Callback cb;
+    const Backoff *backoff;  // rereads the interval after each call if set
+    std::chrono::milliseconds interval;
+    uint64_t due;            // CLOCK_MONOTONIC ns
+    bool parked;             // a retry() that succeeded
+  };
+
+  static const uint64_t PARKED = UINT64_MAX;
+
+  int _epfd;
+  std::vector<std::unique_ptr<MinuteTimer>> _minute_timers;
+  std::vector<std::unique_ptr<Source>> _sources;
+  std::vector<std::unique_ptr<Job>> _jobs;
+  uint64_t _wakeups;
+
+  static std::chrono::milliseconds _interval(const Job &j) {
+    return j.backoff ? j.backoff->interval() : j.interval;
+  }
+
+  // How early a job may run to share a wakeup with another: an eighth of
+  // its interval, so a 5s metric is never more than 625ms ahead.
+  static uint64_t _window(const Job &j) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(_interval(j)).count() / 8;
+  }
+
+  // Milliseconds until the next job is due, for epoll_wait().
+  int _timeout() const {
+    uint64_t next = PARKED;
+    for (const auto &j : _jobs) {
+      next = std::min(next, j->due);
+    }
+    if (next == PARKED) {
+      return -1;
+    }
+    const uint64_t now = monotonic_ns();
+    if (next <= now) {
+      return 0;
+    }
+    return int(std::min<uint64_t>((next - now + 999999) / 1000000, INT_MAX));
+  }
+
+  // Runs every job that is due or within its window of being due, so a
+  // wakeup for one picks up all the others that are close.
+  bool _run_jobs() {
+    const uint64_t now = monotonic_ns();
+    bool refreshed = false;
+    // Jobs may add jobs; those wait for the next round.
+    const size_t n = _jobs.size();
+    for (size_t i = 0; i < n; ++i) {
+      Job &j = *_jobs[i];
+      if (j.due == PARKED || j.due > now + _window(j)) {
+        continue;
+      }
+      if (j.cb()) {
+        refreshed = true;
+      }
+      const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(_interval(j)).count();
+      j.due = j.parked ? PARKED : now + ns;
+    }
+    return refreshed;
+  }
+
+  static std::atomic<uint64_t> &_all_wakeups() {
+    static std::atomic<uint64_t> n(0);
+    return n;
+  }
+
+public:
+  EventLoop() : _epfd(epoll_create1(EPOLL_CLOEXEC)), _wakeups(0) {
+    if (_epfd < 0) {
+      err(1, "epoll_create1");
+    }
+  }
+  ~EventLoop() {
+    close(_epfd);
+  }
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  // Calls cb whenever fd becomes readable.
+  void watch(int fd, Callback cb) {
+    _sources.emplace_back(new Source{fd, cb});
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = _sources.back().get();
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      err(1, "epoll_ctl");
+    }
+  }
+
+  // Stops watching fd.  Safe to call from inside a callback; the source
+  // is only freed once the current batch of events has been dispatched.
+  void unwatch(int fd) {
+    for (auto &s : _sources) {
+      if (s->fd == fd) {
+        epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+        s->fd = -1;
+      }
+    }
+  }
+
+  // Calls cb right away and then once every interval.  All periodic
+  // callbacks share the loop's one deadline (see _run_jobs()), and that
+  // deadline is an epoll_wait() timeout, which the kernel's timer slack
+  // applies to.
+  void every(std::chrono::milliseconds interval, Callback cb) {
+    _jobs.emplace_back(new Job{cb, nullptr, interval, monotonic_ns(), false});
+  }
+
+  // Calls cb right away and then at the top of every minute.
+  void every_minute(Callback cb) {
+    _minute_timers.emplace_back(new MinuteTimer);
+    const MinuteTimer *t = _minute_timers.back().get();
+    cb();
+    watch(t->fd(), [t, cb]() {
+        return t->expired() && cb();
+      });
+  }
+
+  // Like every(), but rereads b's interval after each call so cb can
+  // stretch or tighten its own schedule.
+  void every(const Backoff &b, Callback cb) {
+    _jobs.emplace_back(new Job{cb, &b, b.interval(), monotonic_ns(), false});
+  }
+
+  // Calls connect right away and, for as long as it returns false, again
+  // after each of b's intervals as b backs off.  Once connect succeeds the
+  // job is parked; the returned function starts the attempts over, for
+  // when whatever connect set up goes away.
+  std::function<void()> retry(Backoff &b, std::function<bool()> connect) {
+    _jobs.emplace_back(new Job{nullptr, &b, b.interval(), monotonic_ns(), false});
+    Job *j = _jobs.back().get();
+    j->cb = [j, &b, connect]() {
+      if (connect()) {
+        b.moved();
+        j->parked = true;
+      } else {
+        b.steady();
+      }
+      return false;
+    };
+    return [j]() {
+      j->parked = false;
+      j->due = monotonic_ns();
+    };
+  }
+
+  // Blocks until at least one source fires or a job is due.  Runs the
+  // callbacks of all the sources that are ready and all the jobs that are
+  // close enough to due, then returns true if any of them refreshed.
+  bool wait() {
+    struct epoll_event evs[16];
+    int n;
+    while ((n = epoll_wait(_epfd, evs, sizeof evs / sizeof evs[0], _timeout())) < 0) {
+      if (errno != EINTR) {
+        err(1, "epoll_wait");
+      }
+    }
+    ++_wakeups;
+    ++_all_wakeups();
+    bool refreshed = false;
+    for (int i = 0; i < n; ++i) {
+      Source *s = static_cast<Source *>(evs[i].data.ptr);
+      if (s->fd >= 0 && s->cb()) {
+        refreshed = true;
+      }
+    }
+    _sources.erase(std::remove_if(_sources.begin(), _sources.end(),
+                                  [](const std::unique_ptr<Source> &s) { return s->fd < 0; }),
+                   _sources.end());
+    if (_run_jobs()) {
+      refreshed = true;
+    }
+    return refreshed;
+  }
+
+  uint64_t wakeups() const { return _wakeups; }
+
+  // Wakeups of every loop in the process, the figure that matters for
+  // how often we keep the cpu out of its idle states.
+  static uint64_t all_wakeups() { return _all_wakeups(); }
+};
+
+// A single-writer seqlock around a trivially copyable value.  The writer
+// never waits, and readers retry if they raced with a store, so neither side
+// ever blocks on the other.
+template<class T>
+class Seqlock {
+  static_assert(std::is_trivially_copyable<T>::value, "Seqlock needs a trivially copyable type");
+  std::atomic<unsigned> _seq;
+  T _value;
+
+public:
+  Seqlock() : _seq(0), _value() {}
+  explicit Seqlock(const T &v) : _seq(0), _value(v) {}
+
+  void store(const T &v) {
+    const unsigned seq = _seq.load(std::memory_order_relaxed);
+    _seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&_value, &v, sizeof v);
+    _seq.store(seq + 2, std::memory_order_release);
+  }
+
+  T load() const {
+    T v;
+    unsigned before, after;
+    do {
+      before = _seq.load(std::memory_order_acquire);
+      memcpy(&v, &_value, sizeof v);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = _seq.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return v;
+  }
+};
+
+// A thread with its own EventLoop for sources that can block (a slow
+// wpa_supplicant, ALSA).  They publish snapshots and call notify(); the
+// main loop watches fd() and picks the snapshots up, so it never waits on
+// their I/O.
+class Worker {
+  int _efd, _inbox;
+
+  static int _eventfd() {
+    const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+      err(1, "eventfd");
+    }
+    return fd;
+  }
+
+  static void _signal(int fd) {
+    const uint64_t one = 1;
+    if (write(fd, &one, sizeof one) != sizeof one && errno != EAGAIN) {
+      err(1, "write(eventfd)");
+    }
+  }
+
+  static void _drain(int fd) {
+    uint64_t n;
+    while (read(fd, &n, sizeof n) == sizeof n) {}
+  }
+
+public:
+  // Runs setup(loop) on the new thread to register its sources, then
+  // serves that loop forever.
+  template<class F>
+  explicit Worker(F setup) : _efd(_eventfd()), _inbox(_eventfd()) {
+    std::thread([setup]() {
+        EventLoop loop;
+        setup(loop);
+        for (;;) {
+          loop.wait();
+        }
+      }).detach();
+  }
+  Worker(const Worker &) = delete;
+  Worker &operator=(const Worker &) = delete;
+
+  int fd() const { return _efd; }
+
+  // Called on the worker thread after publishing something new.
+  void notify() { _signal(_efd); }
+
+  // Called on the main thread before reading the snapshots.
+  void drain() { _drain(_efd); }
+
+  // The other way round: the main thread post()s after storing something
+  // for the worker, which watches inbox() and take()s.
+  int inbox() const { return _inbox; }
+  void post() { _signal(_inbox); }
+  void take() { _drain(_inbox); }
+};
+
+// Appends to a fixed buffer supplied by the caller, with just enough
+// formatting for the status line.  Nothing is ever allocated: output that
+// doesn't fit is dropped, and overflowed() says so.
+class Writer {
+  char *_buf;
+  size_t _cap, _len;
+  bool _overflowed;
+
+public:
+  Writer(char *buf, size_t cap) : _buf(buf), _cap(cap), _len(0), _overflowed(false) {
+    _buf[0] = '\0';
+  }
+
+  void clear() {
+    _len = 0;
+    _overflowed = false;
+    _buf[0] = '\0';
+  }
+
+  Writer &write(const char *s, size_t n) {
+    if (_len + n >= _cap) {
+      n = _cap - _len - 1;
+      _overflowed = true;
+    }
+    memcpy(&_buf[_len], s, n);
+    _len += n;
+    _buf[_len] = '\0';
+    return *this;
+  }
+
+  Writer &operator<<(char c) { return write(&c, 1); }
+  Writer &operator<<(const char *s) { return write(s, strlen(s)); }
+  Writer &operator<<(const std::string &s) { return write(s.data(), s.size()); }
+  Writer &operator<<(int v) { return num(v); }
+  Writer &operator<<(long v) { return num(v); }
+
+  // Decimal, zero-padded to at least width digits.
+  Writer &num(long long v, int width = 1) {
+    char tmp[24];
+    char *p = &tmp[sizeof tmp];
+    const bool neg = v < 0;
+    unsigned long long u = neg ? -(unsigned long long) v : v;
+    do {
+      *--p = '0' + u % 10;
+      u /= 10;
+    } while (u);
+    while (&tmp[sizeof tmp] - p < width) {
+      *--p = '0';
+    }
+    if (neg) {
+      *--p = '-';
+    }
+    return write(p, &tmp[sizeof tmp] - p);
+  }
+
+  // Fixed-point with prec digits after the point, like std::fixed.
+  Writer &fixed(double v, int prec) {
+    static const long long scale[] = {1, 10, 100, 1000, 10000};
+    prec = std::max(0, std::min(4, prec));
+    if (std::isnan(v)) {
+      return *this << "nan";
+    }
+    if (v < 0) {
+      *this << '-';
+      v = -v;
+    }
+    if (std::isinf(v)) {
+      return *this << "inf";
+    }
+    const long long x = (long long) (v * scale[prec] + 0.5);
+    num(x / scale[prec]);
+    if (prec) {
+      *this << '.';
+      num(x % scale[prec], prec);
+    }
+    return *this;
+  }
+
+  const char *data() const { return _buf; }
+  const char *c_str() const { return _buf; }
+  size_t size() const { return _len; }
+  bool overflowed() const { return _overflowed; }
+};
+
+enum Color {
+  NORMAL = 1,
+  SELECTED,
+  RED,
+  ORANGE,
+  YELLOW,
+  BLUE,
+  CYAN,
+  GREEN
+};
+
+class Metric {
+public:
+  class ColorScope {
+    Writer &_w;
+    Color _c;
   public:
-    MixerLoader(snd_mixer_t *handle) : _handle(handle) {
-      if (snd_mixer_load(handle) != 0) {
-        err(1, "snd_mixer_load");
+    ColorScope(Writer &w, enum Color c) : _w(w), _c(c) {
+      if (_c != NORMAL) {
+        _w << (char) _c;
       }
     }
-    ~MixerLoader() {
-      snd_mixer_free(_handle);
+    ~ColorScope() {
+      if (_c != NORMAL) {
+        _w << '\x01';
+      }
+    }
+  };
+
+public:
+  // Bytes to reserve for this metric's Segment.
+  size_t capacity() const { return 1<<10; }
+};
+
+// Every metric has color() and render(Writer &), found at compile time:
+// nothing is virtual, so writing a metric inlines all the way down.
+template<class M>
+typename std::enable_if<std::is_base_of<Metric, M>::value, Writer &>::type
+operator<<(Writer &w, const M &metric) {
+  Metric::ColorScope cs(w, metric.color());
+  metric.render(w);
+  return w;
+}
+
+// The usual five-step color ramp, from BLUE up to RED as v passes each
+// threshold.
+constexpr enum Color grade(double v, double red, double orange, double yellow, double green) {
+  return ((v > red)
+          ? RED
+          : ((v > orange)
+             ? ORANGE
+             : ((v > yellow)
+                ? YELLOW
+                : ((v > green)
+                   ? GREEN
+                   : BLUE))));
+}
+
+// Where a ramp turns RED, ORANGE, YELLOW and GREEN.
+struct Grades {
+  double red, orange, yellow, green;
+};
+
+constexpr enum Color grade(double v, const Grades &g) {
+  return grade(v, g.red, g.orange, g.yellow, g.green);
+}
+
+// What the config file can change without a rebuild, parsed into plain
+// values that the collectors read in place of their old constants.  Only
+// the main thread reads it; the worker gets its part (the mixer) handed
+// over when it changes.
+struct Config {
+  // Metric names in the order they're drawn; empty draws them all in
+  // StatusLayout order.
+  std::vector<std::string> order;
+  // Interfaces for Net, or empty to follow the default route.
+  std::vector<std::string> interfaces;
+  // Rates at the top of the Net sparkline.
+  double max_rx_mbit = 50, max_tx_mbit = 5;
+  std::string alsa_card = "default", alsa_mixer = "Master";
+  // Series and stacks in place of runs of Bars; see dwmstatus-bars.h.
+  bool compact_bars = false;
+  // A Cpuinfo::Grouping, and processes per list in Top; -1 for the
+  // built-in default.
+  int grouping = -1, top = -1;
+  Grades cpu{90, 75, 50, 10};
+  Grades temp{80, 65, 50, -HUGE_VAL};
+  Grades rx{4500, 2000, 1000, 100}, tx{1000, 500, 100, 50};  // kB/s
+  Grades disk{90, 75, 50, 10};
+  Grades psi{40, 20, 10, 1};
+  // Battery percentages turn RED, ORANGE and YELLOW below these instead.
+  Grades battery{10, 20, 30, -HUGE_VAL};
+};
+
+static Config &config() {
+  static Config c;
+  return c;
+}
+
+class Separator : public Metric {
+public:
+  enum Color color() const { return NORMAL; }
+  void render(Writer &w) const { w << "::"; }
+};
+
+// One rectangle for dwm to draw, in the encoding dwmstatus-bars.h
+// describes.
+class Bar : public Metric {
+  const int _x, _y, _w, _h, _skip;
+  const bool _filled;
+  const Color _c;
+public:
+  // Bytes per encoded bar.
+  static const size_t SIZE = DWMSTATUS_BAR_HEADER;
+
+  // Whether to send runs of bars as the series and stacks of
+  // dwmstatus-bars.h, which a dwm has to know to decode.
+  static bool compact() { return config().compact_bars; }
+
+  constexpr Bar(int x, int y, int w, int h, int skip, bool filled, Color c)
+    : _x(x),
+      _y(y),
+      _w(w),
+      _h(h),
+      _skip(skip),
+      _filled(filled),
+      _c(c)
+  {}
+  constexpr Color color() const { return NORMAL; }
+
+  // Largest coordinate that still fits in a byte after the offset below.
+  static const int MAX_COORD = 126;
+
+  // Byte k of the encoding: color and flags, then x, y, w, h and skip,
+  // each off by one so none of them is NUL.  Coordinates are clamped to
+  // [0, MAX_COORD] rather than wrapping into the next field's meaning.
+  static constexpr char coord(int v) {
+    return char((v < 0 ? 0 : v > MAX_COORD ? MAX_COORD : v) + 1);
+  }
+  constexpr char byte(size_t k) const {
+    return (k == 0
+            ? char(char(_c) | (1<<7) | (_filled ? DWMSTATUS_BAR_FILLED : 0))
+            : coord(k == 1 ? _x : k == 2 ? _y : k == 3 ? _w : k == 4 ? _h : _skip));
+  }
+
+  // The header of a series or stack; the fields are coordinates as above.
+  static void header(Writer &w, int opcode, int a, int b, int c, int d, int e) {
+    const char buf[SIZE] = {
+      char((1<<7) | DWMSTATUS_BAR_OPCODE | opcode), coord(a), coord(b), coord(c), coord(d), coord(e)
+    };
+    w.write(buf, sizeof buf);
+  }
+
+  void render(Writer &w) const {
+    const char buf[SIZE] = {byte(0), byte(1), byte(2), byte(3), byte(4), byte(5)};
+    w.write(buf, sizeof buf);
+  }
+};
+
+// Bars side by side on one row, like Meminfo's used, buffers and cache,
+// optionally in an outline `frame' wide, after which the pen moves by
+// skip.  One STACK when Bar::compact(), else a Bar for each part.
+class Stack : public Metric {
+public:
+  static const size_t MAX = 4;
+
+private:
+  const int _y, _h, _frame, _skip;
+  int _w[MAX];
+  Color _c[MAX];
+  size_t _n;
+
+public:
+  Stack(int y, int h, int frame, int skip) : _y(y), _h(h), _frame(frame), _skip(skip), _n(0) {}
+
+  Stack &operator()(int w, Color c) {
+    if (_n < MAX) {
+      _w[_n] = w;
+      _c[_n++] = c;
+    }
+    return *this;
+  }
+
+  Color color() const { return NORMAL; }
+  void render(Writer &w) const {
+    if (Bar::compact()) {
+      Bar::header(w, DWMSTATUS_BAR_STACK, int(_n), _y, _h, _frame, _skip);
+      char parts[2 * MAX];
+      for (size_t i = 0; i < _n; ++i) {
+        parts[2 * i] = char((1<<7) | _c[i]);
+        parts[2 * i + 1] = Bar::coord(_w[i]);
+      }
+      w.write(parts, 2 * _n);
+      return;
     }
+    int x = 0;
+    for (size_t i = 0; i < _n; ++i) {
+      w << Bar(x, _y, _w[i], _h, (_frame || i + 1 < _n) ? 0 : _skip, true, _c[i]);
+      x += _w[i];
+    }
+    if (_frame) {
+      w << Bar(0, _y, _frame, _h, _skip, false, NORMAL);
+    }
+  }
+};
+
+// How a RingHistory draws one of its series: each slot a column w wide
+// and up to 15 high, standing on row y or hanging from it if down, step
+// apart.
+struct Series {
+  int y, w, step;
+  bool down;
+};
+
+// The last N samples of something, each with the time it was taken and a
+// column in each of up to BARS series, as in a sparkline.  A slot's
+// columns are encoded once, when it's pushed, both as Bars and as the
+// bytes of a SERIES, so redrawing is a copy of each slot either way.
+template<class T, size_t N, size_t BARS = 2>
+class RingHistory {
+  static_assert(N <= Bar::MAX_COORD, "a SERIES header holds its column count as a Bar::coord");
+
+  struct Slot {
+    T value;
+    uint64_t ns;  // Trace::now()
+    char bars[BARS * Bar::SIZE + 1];  // Writer keeps room for a NUL
+    size_t nbars;
+    char columns[BARS];
   };
+  const std::array<Series, BARS> _series;
+  Slot _slots[N];
+  size_t _n;
+
+  const Slot &_slot(size_t age) const { return _slots[(_n - 1 - age) % N]; }
+
+public:
+  explicit RingHistory(const std::array<Series, BARS> &series) : _series(series), _n(0) {}
+
+  void push(const T &v) {
+    Slot &s = _slots[_n++ % N];
+    s.value = v;
+    s.ns = Trace::now();
+    s.nbars = 0;
+  }
+
+  // Sets the newest sample's column in each series, as (height, color)
+  // pairs; a sample that isn't encoded isn't drawn.
+  void encode(const std::array<std::pair<int, Color>, BARS> &columns) {
+    Slot &s = _slots[(_n - 1) % N];
+    Writer w(s.bars, sizeof s.bars);
+    for (size_t k = 0; k < BARS; ++k) {
+      const Series &series = _series[k];
+      const int h = std::max(0, std::min(15, columns[k].first));
+      w << Bar(0, series.down ? series.y : series.y - h + 1, series.w, h,
+               k + 1 < BARS ? 0 : series.step, true, columns[k].second);
+      s.columns[k] = char((1<<7) | (columns[k].second - 1) << 4 | h);
+    }
+    s.nbars = w.size();
+  }
+
+  size_t size() const { return std::min(_n, N); }
+
+  // The sample `age' pushes ago; 0 is the newest.
+  const T &operator[](size_t age) const { return _slot(age).value; }
+
+  // Seconds between the sample `age' pushes ago and the one before it.
+  double seconds(size_t age) const {
+    return (_slot(age).ns - _slot(age + 1).ns) / 1e9;
+  }
+
+  // Every slot's bars, oldest first.  Compact, each series is one
+  // SERIES, all but the last leaving the pen for the next to draw over.
+  void render(Writer &w) const {
+    if (!Bar::compact()) {
+      for (size_t age = size(); age-- > 0;) {
+        const Slot &s = _slot(age);
+        w.write(s.bars, s.nbars);
+      }
+      return;
+    }
+    for (size_t k = 0; k < BARS; ++k) {
+      char columns[N];
+      size_t n = 0;
+      for (size_t age = size(); age-- > 0;) {
+        const Slot &s = _slot(age);
+        if (s.nbars) {
+          columns[n++] = s.columns[k];
+        }
+      }
+      const Series &series = _series[k];
+      Bar::header(w, DWMSTATUS_BAR_SERIES, int(n), series.y, series.w, series.step,
+                  (series.down ? DWMSTATUS_SERIES_DOWN : 0) |
+                  (k + 1 < BARS ? DWMSTATUS_SERIES_KEEP : 0));
+      w.write(columns, n);
+    }
+  }
+};
+
+// A percentage over its last N samples, one pixel column per sample.
+template<size_t N>
+class Sparkline : public Metric {
+  RingHistory<int, N, 1> _h;
+public:
+  Sparkline() : _h(std::array<Series, 1>{{Series{12, 1, 1, false}}}) {}
+
+  void push(int pct, Color c) {
+    _h.push(pct);
+    _h.encode({{std::make_pair(std::max(0, std::min(12, 12 * pct / 100)), c)}});
+  }
+  Color color() const { return NORMAL; }
+  void render(Writer &w) const { _h.render(w); }
+};
+
+class Load : public Metric {
+  double one, five, fifteen;
+public:
+  Load() : one(0), five(0), fifteen(0) {
+    static File f("/proc/loadavg");
+    if (f.read()) {
+      sscanf(f.data(), "%lf %lf %lf", &one, &five, &fifteen);
+    }
+  }
+  double one_minute() const { return one; }
+
+  enum Color color() const {
+    static int ncpu = getncpu();
+    return ((one>2*ncpu)
+            ? RED
+            : ((one>3*ncpu/2)
+               ? ORANGE
+               : ((one>ncpu)
+                  ? YELLOW
+                  : BLUE)));
+  }
+  void render(Writer &w) const {
+    w.fixed(one, 2) << " ";
+    w.fixed(five, 2) << " ";
+    w.fixed(fifteen, 2);
+  }
+};
+
+// Parses the unsigned decimal at p, skipping leading blanks, and leaves p
+// just past it.
+static inline size_t parse_size(const char *&p) {
+  while (*p == ' ') {
+    ++p;
+  }
+  size_t v = 0;
+  for (; *p >= '0' && *p <= '9'; ++p) {
+    v = v * 10 + (*p - '0');
+  }
+  return v;
+}
+
+// K columns of ever-growing counters (jiffies, bytes, sectors) for each of
+// n rows.  Samples alternate between two tables, one array per column, so
+// the deltas over the last interval are a straight subtraction loop and
+// nothing is copied from one sample to the next.
+template<size_t K>
+class DeltaCounter {
+  std::array<std::vector<uint64_t>, K> _tables[2];
+  uint64_t _ns[2];
+  int _cur;
+
+public:
+  explicit DeltaCounter(size_t n = 0) : _ns{0, 0}, _cur(0) {
+    resize(n);
+  }
+
+  // Zeroes both tables.
+  void resize(size_t n) {
+    for (auto &table : _tables) {
+      for (auto &column : table) {
+        column.assign(n, 0);
+      }
+    }
+    _ns[0] = _ns[1] = 0;
+  }
+
+  size_t size() const { return _tables[0][0].size(); }
+
+  // Makes the older table current and zeroes it, ready for the caller to
+  // fill in through column().
+  void next() {
+    _cur = !_cur;
+    for (auto &column : _tables[_cur]) {
+      std::fill(column.begin(), column.end(), 0);
+    }
+    _ns[_cur] = Trace::now();
+  }
+
+  uint64_t *column(size_t k) { return _tables[_cur][k].data(); }
+  const uint64_t *current(size_t k) const { return _tables[_cur][k].data(); }
+  const uint64_t *last(size_t k) const { return _tables[!_cur][k].data(); }
+
+  // How far column k of row i moved since the last sample; 0 if it went
+  // backwards, as when a device is replaced under the same name.
+  uint64_t delta(size_t k, size_t i) const {
+    const uint64_t c = current(k)[i], l = last(k)[i];
+    return c > l ? c - l : 0;
+  }
+
+  // Seconds between the last two samples, 0 before there are two.
+  double seconds() const {
+    return _ns[0] && _ns[1] ? (_ns[_cur] - _ns[!_cur]) / 1e9 : 0;
+  }
+
+  double rate(size_t k, size_t i) const {
+    const double s = seconds();
+    return s > 0 ? delta(k, i) / s : 0;
+  }
+};
+
+class Cpuinfo : public Metric {
+public:
+  // How render() draws the cpus, one row of bars each.
+  enum Grouping {
+    PER_CPU,      // a row per cpu
+    NUMA,         // a row per NUMA node
+    L3,           // a row per shared L3 cache (a CCX on AMD)
+    PERCENTILES,  // the idlest, median, p95 and busiest cpu
+  };
+
+  // Rows that fit in a Bar's coordinates.
+  static const int MAX_ROWS = 41;
+
+private:
+  // Jiffies from /proc/stat, so that computing the percentages is a
+  // handful of straight loops.  Row 0 is the aggregate line, then one per
+  // cpu line.
+  enum Column {
+    TOTAL,
+    USER,
+    SYS,
+    IO,
+  };
+
+  struct Row {
+    uint8_t user, sys, io;
+  };
+
+  File f;
+  const int nelts;
+  DeltaCounter<4> _counters;
+  // Percentages over the last interval, by table index.
+  std::vector<uint8_t> _user, _sys, _io, _busy;
+  int _last_pct;
+  // The N of each line's "cpuN", -1 for the aggregate.
+  std::vector<int> _ids;
+
+  Grouping _grouping;
+  // Table indices in each NUMA node or L3 group.
+  std::vector<std::vector<int>> _groups;
+  std::vector<Row> _rows;
+  std::vector<int> _order;
+
+  // The aggregate line plus one per cpu line in /proc/stat.
+  static int count_cpus(File &f) {
+    int n = 0;
+    if (f.read()) {
+      for (const char *p = f.data(); strncmp(p, "cpu", 3) == 0; p = next_line(p)) {
+        ++n;
+      }
+    }
+    return n ? n : getncpu() + 1;
+  }
+
+  int _index_of(int id) const {
+    auto it = std::find(_ids.begin(), _ids.end(), id);
+    return it == _ids.end() ? -1 : int(it - _ids.begin());
+  }
+
+  // Table indices of the cpus in a cpulist like "0-3,8-11".
+  std::vector<int> _parse_cpulist(const std::string &list) const {
+    std::vector<int> ret;
+    const char *p = list.c_str();
+    while (*p) {
+      char *end;
+      const long lo = strtol(p, &end, 10);
+      if (end == p) {
+        break;
+      }
+      long hi = lo;
+      p = end;
+      if (*p == '-') {
+        hi = strtol(p + 1, &end, 10);
+        p = end;
+      }
+      for (long id = lo; id <= hi; ++id) {
+        const int i = _index_of(int(id));
+        if (i > 0) {
+          ret.push_back(i);
+        }
+      }
+      if (*p == ',') {
+        ++p;
+      }
+    }
+    return ret;
+  }
+
+  void _add_group(const std::string &cpulist) {
+    std::vector<int> g = _parse_cpulist(cpulist);
+    if (!g.empty() && std::find(_groups.begin(), _groups.end(), g) == _groups.end()) {
+      _groups.push_back(g);
+    }
+  }
+
+  void _discover_groups() {
+    _groups.clear();
+    if (_grouping == NUMA) {
+      const std::string nodes = "/sys/devices/system/node";
+      if (dir_exists(sysroot() + nodes)) {
+        Dir dir((sysroot() + nodes).c_str());
+        while (const char *name = dir.next()) {
+          if (strncmp(name, "node", 4) == 0 && isdigit(name[4])) {
+            _add_group(read_line(nodes + "/" + name + "/cpulist"));
+          }
+        }
+      }
+    } else if (_grouping == L3) {
+      for (int id : _ids) {
+        if (id < 0) {
+          continue;
+        }
+        const std::string cache = "/sys/devices/system/cpu/cpu" + std::to_string(id) + "/cache";
+        for (int k = 0; dir_exists(sysroot() + cache + "/index" + std::to_string(k)); ++k) {
+          const std::string index = cache + "/index" + std::to_string(k);
+          if (read_line(index + "/level") == "3") {
+            _add_group(read_line(index + "/shared_cpu_list"));
+          }
+        }
+      }
+    }
+    std::sort(_groups.begin(), _groups.end());
+    if (_groups.size() > size_t(MAX_ROWS)) {
+      _groups.resize(MAX_ROWS);
+    }
+  }
+
+  // user, sys and iowait as percentages of total over the last interval,
+  // for every line at once.
+  void _percentages() {
+    const uint64_t *ct = _counters.current(TOTAL), *lt = _counters.last(TOTAL);
+    const uint64_t *cu = _counters.current(USER), *lu = _counters.last(USER);
+    const uint64_t *cs = _counters.current(SYS), *ls = _counters.last(SYS);
+    const uint64_t *ci = _counters.current(IO), *li = _counters.last(IO);
+    for (int i = 0; i < nelts; ++i) {
+      const float dt = float(ct[i] - lt[i]);
+      const float scale = dt > 0 ? 100.0f / dt : 0.0f;
+      _user[i] = uint8_t(std::min(100.0f, float(cu[i] - lu[i]) * scale));
+      _sys[i] = uint8_t(std::min(100.0f, float(cs[i] - ls[i]) * scale));
+      _io[i] = uint8_t(std::min(100.0f, float(ci[i] - li[i]) * scale));
+    }
+    for (int i = 0; i < nelts; ++i) {
+      _busy[i] = uint8_t(_user[i] + _sys[i]);
+    }
+  }
+
+  void _group_rows() {
+    _rows.clear();
+    if (_grouping == PERCENTILES) {
+      _order.clear();
+      for (int i = 1; i < nelts; ++i) {
+        _order.push_back(i);
+      }
+      std::sort(_order.begin(), _order.end(), [this](int a, int b) { return _busy[a] < _busy[b]; });
+      const size_t n = _order.size();
+      if (n) {
+        for (size_t rank : {size_t(0), n / 2, std::min(n - 1, n * 95 / 100), n - 1}) {
+          const int i = _order[rank];
+          _rows.push_back(Row{_user[i], _sys[i], _io[i]});
+        }
+      }
+    } else if (!_groups.empty()) {
+      for (const auto &g : _groups) {
+        uint64_t dt = 0, du = 0, ds = 0, di = 0;
+        for (int i : g) {
+          dt += _counters.delta(TOTAL, i);
+          du += _counters.delta(USER, i);
+          ds += _counters.delta(SYS, i);
+          di += _counters.delta(IO, i);
+        }
+        const double scale = dt ? 100.0 / dt : 0;
+        _rows.push_back(Row{uint8_t(du * scale), uint8_t(ds * scale), uint8_t(di * scale)});
+      }
+    } else {
+      for (int i = 1; i < nelts && int(_rows.size()) < MAX_ROWS; ++i) {
+        _rows.push_back(Row{_user[i], _sys[i], _io[i]});
+      }
+    }
+  }
+
+public:
+  static const char *name() { return "Cpuinfo"; }
+  static std::chrono::milliseconds interval() { return std::chrono::seconds(5); }
+
+  Cpuinfo()
+    : f("/proc/stat", 1<<15),
+      nelts(count_cpus(f)),
+      _counters(nelts),
+      _user(nelts, 0), _sys(nelts, 0), _io(nelts, 0), _busy(nelts, 0),
+      _last_pct(0),
+      _ids(nelts, -1),
+      _grouping(default_grouping()) {
+    _rows.reserve(std::max(nelts, 4));
+    _order.reserve(nelts);
+    if (f.read()) {
+      const char *p = f.data();
+      for (int i = 0; i < nelts && strncmp(p, "cpu", 3) == 0; ++i, p = next_line(p)) {
+        _ids[i] = isdigit(p[3]) ? atoi(p + 3) : -1;
+      }
+    }
+    sample();
+  }
+
+  // Big machines default to PERCENTILES, since a row per cpu wouldn't fit.
+  Grouping default_grouping() const {
+    return nelts - 1 <= MAX_ROWS ? PER_CPU : PERCENTILES;
+  }
+
+  // NUMA and L3 fall back to a row per cpu if sysfs doesn't describe them.
+  void group(Grouping g) {
+    _grouping = g;
+    _discover_groups();
+    _group_rows();
+  }
+
+  // Reads /proc/stat into the older table and makes it the current one.
+  void sample() {
+    _last_pct = pct(0);
+    _counters.next();
+    uint64_t *total = _counters.column(TOTAL), *user = _counters.column(USER),
+      *sys = _counters.column(SYS), *io = _counters.column(IO);
+    if (f.read()) {
+      const char *p = f.data();
+      for (int i = 0; i < nelts && strncmp(p, "cpu", 3) == 0; ++i, p = next_line(p)) {
+        p += strcspn(p, " \n");
+        for (int field = 0; *p == ' '; ++field) {
+          const size_t jiffies = parse_size(p);
+          if (field < 2) {
+            user[i] += jiffies;
+          } else if (field == 2) {
+            sys[i] += jiffies;
+          } else if (field == 4) {
+            io[i] += jiffies;
+          }
+          total[i] += jiffies;
+        }
+      }
+    }
+    _percentages();
+    _group_rows();
+  }
+
+  int ncpu() const { return nelts - 1; }
+
+  // The text, three bars per row and a trend sparkline.
+  size_t capacity() const { return 256 + 18 * std::min(ncpu(), int(MAX_ROWS)); }
+
+  int pct(int i) const { return _busy[i]; }
+  int user(int i) const { return _user[i]; }
+  int sys(int i) const { return _sys[i]; }
+  int io(int i) const { return _io[i]; }
+
+  enum Color color() const {
+    return NORMAL;
+  }
+  // Where color_for() turns YELLOW.
+  static double busy() { return config().cpu.yellow; }
+
+  // Nothing is busy and the total moved by less than a few points.
+  bool steady() const {
+    if (std::abs(pct(0) - _last_pct) >= 5) {
+      return false;
+    }
+    return std::none_of(_busy.begin(), _busy.end(), [](uint8_t p) { return p > busy(); });
+  }
+
+  enum Color color_for(int i) const {
+    return grade(pct(i), config().cpu);
+  }
+  void render(Writer &w) const {
+    {
+      ColorScope cs(w, color_for(0));
+      w << user(0) << "% "
+         << sys(0) << "% "
+         << io(0) << "%";
+    }
+    const int nrows = _rows.size();
+    for (int r = 0; r < nrows; ++r) {
+      const Row &row = _rows[r];
+      const int y = 2 + r * 3;
+      w << Stack(y, 2, 0, (r == nrows - 1) ? 41 : 0)
+        (40 * row.user / 100, BLUE)(40 * row.sys / 100, YELLOW)(40 * row.io / 100, RED);
+    }
+  }
+};
+
+// What /proc/meminfo says about memory in use, read in one pass over the
+// file: each line's key is looked up in a sorted table of the ones we
+// want, and everything but those is skipped without parsing its value.
+// "Used" is what MemAvailable says can't be had back, so tmpfs and the
+// unreclaimable slab count and reclaimable cache doesn't; kernels before
+// MemAvailable get an estimate from the same parts.
+class Meminfo : public Metric {
+  enum Field {
+    TOTAL,
+    FREE,
+    AVAILABLE,
+    BUFFERS,
+    CACHED,
+    SHMEM,
+    SRECLAIMABLE,
+    SWAP_TOTAL,
+    SWAP_FREE,
+    HUGE_TOTAL,  // pages, not kB
+    HUGE_FREE,
+    HUGE_SIZE,
+    NFIELDS
+  };
+
+  struct Key {
+    const char *name;
+    Field field;
+  };
+
+  File f;
+  size_t _kb[NFIELDS];
+  bool _have_available;
+  size_t _last_used;
+
+  // The key of the line at p, which is len bytes long, or null if it isn't
+  // one we want.
+  static const Key *_find(const char *p, size_t len) {
+    // Sorted by strcmp().
+    static const Key keys[] = {
+      {"Buffers", BUFFERS},
+      {"Cached", CACHED},
+      {"HugePages_Free", HUGE_FREE},
+      {"HugePages_Total", HUGE_TOTAL},
+      {"Hugepagesize", HUGE_SIZE},
+      {"MemAvailable", AVAILABLE},
+      {"MemFree", FREE},
+      {"MemTotal", TOTAL},
+      {"SReclaimable", SRECLAIMABLE},
+      {"Shmem", SHMEM},
+      {"SwapFree", SWAP_FREE},
+      {"SwapTotal", SWAP_TOTAL},
+    };
+    static_assert(sizeof keys / sizeof keys[0] == NFIELDS, "a key for every field");
+    const Key *k = std::lower_bound(std::begin(keys), std::end(keys), 0,
+                                    [p, len](const Key &key, int) {
+                                      return strncmp(key.name, p, len) < 0;
+                                    });
+    return (k != std::end(keys) && strncmp(k->name, p, len) == 0 && k->name[len] == '\0')
+      ? k : nullptr;
+  }
+
+public:
+  static const char *name() { return "Meminfo"; }
+  static std::chrono::milliseconds interval() { return std::chrono::seconds(5); }
+  Meminfo() : f("/proc/meminfo"), _have_available(false), _last_used(0) {
+    std::fill(std::begin(_kb), std::end(_kb), 0);
+    _kb[TOTAL] = 1;
+    sample();
+  }
+
+  void sample() {
+    _last_used = used();
+    if (!f.read()) {
+      return;
+    }
+    std::fill(std::begin(_kb), std::end(_kb), 0);
+    _have_available = false;
+    size_t found = 0;
+    for (const char *p = f.data(); *p && found < NFIELDS; p = next_line(p)) {
+      // Every key starts with one of these, which is all most lines get
+      // looked at for.
+      if (!strchr("BCHMS", *p)) {
+        continue;
+      }
+      const size_t len = strcspn(p, ":\n");
+      if (p[len] != ':') {
+        continue;
+      }
+      if (const Key *k = _find(p, len)) {
+        const char *v = p + len + 1;
+        _kb[k->field] = parse_size(v);
+        _have_available = _have_available || k->field == AVAILABLE;
+        ++found;
+      }
+    }
+    _kb[TOTAL] = std::max<size_t>(_kb[TOTAL], 1);
+  }
+
+  size_t total_kb() const { return _kb[TOTAL]; }
+  size_t free_kb() const { return _kb[FREE]; }
+  size_t buffers_kb() const { return _kb[BUFFERS]; }
+  size_t cached_kb() const { return _kb[CACHED]; }
+  size_t shmem_kb() const { return _kb[SHMEM]; }
+  size_t swap_total_kb() const { return _kb[SWAP_TOTAL]; }
+  size_t swap_used_kb() const { return _kb[SWAP_TOTAL] - std::min(_kb[SWAP_TOTAL], _kb[SWAP_FREE]); }
+  // The hugetlb pool, which is out of MemAvailable whether or not it's in
+  // use.
+  size_t hugepages_kb() const { return _kb[HUGE_TOTAL] * _kb[HUGE_SIZE]; }
+
+  // What could be had without swapping: MemAvailable, or free memory plus
+  // the page cache that isn't tmpfs and the reclaimable slab.
+  size_t available_kb() const {
+    if (_have_available) {
+      return std::min(_kb[AVAILABLE], _kb[TOTAL]);
+    }
+    const size_t cache = _kb[CACHED] - std::min(_kb[CACHED], _kb[SHMEM]);
+    return std::min(_kb[TOTAL], _kb[FREE] + _kb[BUFFERS] + cache + _kb[SRECLAIMABLE]);
+  }
+  size_t used() const { return _kb[TOTAL] - available_kb(); }
+  int pct() const { return int(100 * used() / _kb[TOTAL]); }
+
+  // Used memory moved by less than 1% of the total since the last sample.
+  bool steady() const {
+    const size_t delta = used() > _last_used ? used() - _last_used : _last_used - used();
+    return delta * 100 < _kb[TOTAL];
+  }
+
+  enum Color color() const {
+    const size_t avail = available_kb(), total = _kb[TOTAL];
+    return ((avail*10<total)
+            ? RED
+            : ((avail*5<total)
+               ? ORANGE
+               : ((avail*3<total)
+                  ? YELLOW
+                  : GREEN)));
+  }
+  // kB as "1.5G " or "300.0M ".
+  static void size(Writer &w, size_t kb) {
+    if (kb > (1<<20)) {
+      w.fixed(kb / 1024.0 / 1024.0, 1) << "G ";
+    } else {
+      w.fixed(kb / 1024.0, 1) << "M ";
+    }
+  }
+  // Used, buffers and cache, swap if any is in use, and a bar of what's
+  // used by programs, held by the hugetlb pool and reclaimable.
+  void render(Writer &w) const {
+    const size_t used = this->used(), total = _kb[TOTAL];
+    w << "u "; size(w, used);
+    w << "b "; size(w, _kb[BUFFERS]);
+    w << "c "; size(w, _kb[CACHED]);
+    if (const size_t swap = swap_used_kb()) {
+      w << "s "; size(w, swap);
+    }
+    const size_t huge = std::min(used, hugepages_kb());
+    const size_t reclaimable = available_kb() - std::min(available_kb(), _kb[FREE]);
+    Stack bar(1, 12, 100, 101);
+    bar(int(100 * (used - huge) / total), GREEN);
+    if (huge) {
+      bar(int(100 * huge / total), CYAN);
+    }
+    w << bar(int(100 * reclaimable / total), ORANGE);
+  }
+};
+
+// The processes using the most CPU and the most memory.  /proc stays open
+// as a dirfd that is rewound on every sample, and each process's stat file
+// is opened through it once and then pread() like a File, so a tick on a
+// build server with thousands of processes is one getdents pass and a
+// pread per process, with no paths built and nothing allocated for
+// processes we already know.  Processes are keyed by pid and start time: a
+// recycled pid starts over instead of inheriting its predecessor's ticks.
+class Top : public Metric {
+public:
+  // Processes listed of each kind, at most and by default.
+  static const size_t MAX = 8;
+  static const size_t DEFAULT_LIMIT = 3;
+
+private:
+  struct Proc {
+    int fd = -1;
+    uint64_t start = 0;   // starttime, in clock ticks after boot
+    uint64_t ticks = 0;   // utime + stime
+    uint64_t delta = 0;   // ticks over the last interval
+    size_t rss_kb = 0;
+    unsigned gen = 0;     // the scan that last saw it
+    char comm[16] = "";
+  };
+
+  struct Shown {
+    char comm[16];
+    int pct;
+    size_t rss_kb;
+  };
+
+  // The n biggest values offered, as a min-heap so the smallest is the
+  // one evicted.
+  class Heap {
+    struct Entry {
+      uint64_t value;
+      const Proc *proc;
+    };
+    std::array<Entry, MAX> _e;
+    size_t _n, _cap;
+
+    static bool _greater(const Entry &a, const Entry &b) { return a.value > b.value; }
+
+  public:
+    Heap() : _n(0), _cap(0) {}
+
+    void reset(size_t cap) {
+      _n = 0;
+      _cap = std::min(cap, MAX);
+    }
+
+    void offer(uint64_t value, const Proc *proc) {
+      if (value == 0 || _cap == 0) {
+        return;
+      }
+      if (_n < _cap) {
+        _e[_n++] = Entry{value, proc};
+        std::push_heap(_e.begin(), _e.begin() + _n, _greater);
+      } else if (value > _e[0].value) {
+        std::pop_heap(_e.begin(), _e.begin() + _n, _greater);
+        _e[_n - 1] = Entry{value, proc};
+        std::push_heap(_e.begin(), _e.begin() + _n, _greater);
+      }
+    }
+
+    // Biggest first.  Only reset() is allowed afterwards.
+    void sort() { std::sort_heap(_e.begin(), _e.begin() + _n, _greater); }
+
+    size_t size() const { return _n; }
+    const Proc &operator[](size_t i) const { return *_e[i].proc; }
+  };
+
+  DIR *_dir;
+  std::unordered_map<int, Proc> _procs;
+  unsigned _gen;
+  // Stat fds we keep open.  wpa_ctrl select()s on its sockets, so all our
+  // fds have to stay below FD_SETSIZE.
+  size_t _cached, _budget;
+  const long _hz, _page_kb;
+  uint64_t _last_ns;
+  size_t _n;
+  Heap _by_cpu, _by_rss;
+  Shown _cpu[MAX], _mem[MAX];
+  size_t _ncpu, _nmem;
+  char _buf[1024];
+
+  static std::string _name(int pid) {
+    return "/proc/" + std::to_string(pid) + "/stat";
+  }
+
+  void _close(Proc &p) {
+    if (p.fd >= 0) {
+      close(p.fd);
+      p.fd = -1;
+      --_cached;
+    }
+  }
+
+  // Reads pid's stat line into _buf through p's fd, opening it first if
+  // need be.  Returns the length, or -1 if the process is gone.
+  ssize_t _read(int pid, Proc &p) {
+    if (Trace::replaying()) {
+      const char *data;
+      size_t len;
+      if (!Trace::get(_name(pid), data, len)) {
+        return -1;
+      }
+      len = std::min(len, sizeof _buf - 1);
+      memcpy(_buf, data, len);
+      return len;
+    }
+    if (p.fd < 0) {
+      char path[24];
+      snprintf(path, sizeof path, "%d/stat", pid);
+      if ((p.fd = openat(dirfd(_dir), path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+      }
+      ++_cached;
+    }
+    ssize_t n;
+    while ((n = pread(p.fd, _buf, sizeof _buf - 1, 0)) < 0 && errno == EINTR) {}
+    return n;
+  }
+
+  // comm, utime + stime, starttime and rss out of a stat line.  comm can
+  // hold spaces and parens itself, so fields are counted from the last ')'.
+  bool _parse(Proc &p, uint64_t &ticks, uint64_t &start, size_t &rss) const {
+    const char *open = strchr(_buf, '('), *close = strrchr(_buf, ')');
+    if (!open || !close || close < open || !close[1]) {
+      return false;
+    }
+    const size_t len = std::min(size_t(close - open - 1), sizeof p.comm - 1);
+    // Any process can name itself anything with PR_SET_NAME.
+    copy_printable(p.comm, open + 1, len);
+    ticks = start = rss = 0;
+    // close + 2 is the state, field 3.
+    const char *q = close + 2;
+    for (int field = 3; *q && field <= 24; ++field) {
+      if (field == 14 || field == 15 || field == 22 || field == 24) {
+        const size_t v = parse_size(q);
+        if (field == 22) {
+          start = v;
+        } else if (field == 24) {
+          rss = v;
+        } else {
+          ticks += v;
+        }
+      } else {
+        q += strcspn(q, " ");
+      }
+      while (*q == ' ') {
+        ++q;
+      }
+    }
+    return true;
+  }
+
+  void _visit(int pid) {
+    Proc &p = _procs[pid];
+    ssize_t n = _read(pid, p);
+    if (n < 0 && p.fd >= 0) {
+      // An fd we kept only sees the process it was opened on; if that
+      // died, the pid may already belong to a new one.
+      _close(p);
+      n = _read(pid, p);
+    }
+    if (n <= 0) {
+      // Left with a stale gen, so the sweep in sample() drops it.
+      _close(p);
+      return;
+    }
+    _buf[n] = '\0';
+    if (Trace::recording()) {
+      Trace::write(_name(pid), _buf, n);
+    }
+    uint64_t ticks, start;
+    size_t rss;
+    if (!_parse(p, ticks, start, rss)) {
+      _close(p);
+      return;
+    }
+    if (p.gen == 0 || start != p.start) {
+      // New to us.  On the first scan that's everything, so count from
+      // now; after that it started since the last scan, so all its ticks
+      // fall in this interval.
+      p.start = start;
+      p.ticks = _gen == 1 ? ticks : 0;
+    }
+    p.delta = ticks - std::min(ticks, p.ticks);
+    p.ticks = ticks;
+    p.rss_kb = rss * _page_kb;
+    p.gen = _gen;
+    if (_cached > _budget) {
+      _close(p);
+    }
+  }
+
+public:
+  static const char *name() { return "Top"; }
+  static std::chrono::milliseconds interval() { return std::chrono::seconds(5); }
+
+  explicit Top(size_t n = DEFAULT_LIMIT)
+    : _dir(nullptr), _gen(0), _cached(0), _budget(0),
+      _hz(sysconf(_SC_CLK_TCK)), _page_kb(sysconf(_SC_PAGESIZE) / 1024),
+      _last_ns(0), _n(std::min(n, MAX)), _ncpu(0), _nmem(0) {
+    if (!Trace::replaying()) {
+      const int fd = open((sysroot() + "/proc").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd >= 0 && !(_dir = fdopendir(fd))) {
+        close(fd);
+      }
+    }
+    struct rlimit rl;
+    const size_t limit = getrlimit(RLIMIT_NOFILE, &rl) == 0 ? std::min<size_t>(rl.rlim_cur, FD_SETSIZE) : 256;
+    // Leave room for everything else we open.
+    _budget = limit > 256 ? limit - 256 : 0;
+    sample();
+  }
+  ~Top() {
+    for (auto &kv : _procs) {
+      _close(kv.second);
+    }
+    if (_dir) {
+      closedir(_dir);
+    }
+  }
+  Top(const Top &) = delete;
+  Top &operator=(const Top &) = delete;
+
+  // Lists at most n processes of each kind, up to MAX; 0 hides the metric.
+  void limit(size_t n) { _n = std::min(n, MAX); }
+  size_t limit() const { return _n; }
+
+  void sample() {
+    const uint64_t now = Trace::now();
+    const double elapsed = _last_ns ? (now - _last_ns) / 1e9 : 0;
+    _last_ns = now;
+    ++_gen;
+    if (Trace::replaying()) {
+      for (const std::string &entry : Trace::entries("/proc")) {
+        if (isdigit(entry[0])) {
+          _visit(atoi(entry.c_str()));
+        }
+      }
+    } else if (_dir) {
+      rewinddir(_dir);
+      while (struct dirent *ent = readdir(_dir)) {
+        if (isdigit(ent->d_name[0])) {
+          _visit(atoi(ent->d_name));
+        }
+      }
+    }
+
+    _by_cpu.reset(_n);
+    _by_rss.reset(_n);
+    for (auto it = _procs.begin(); it != _procs.end();) {
+      if (it->second.gen != _gen) {
+        _close(it->second);
+        if (Trace::recording()) {
+          Trace::write(_name(it->first), nullptr, 0);
+        }
+        it = _procs.erase(it);
+        continue;
+      }
+      _by_cpu.offer(it->second.delta, &it->second);
+      _by_rss.offer(it->second.rss_kb, &it->second);
+      ++it;
+    }
+    _by_cpu.sort();
+    _by_rss.sort();
+
+    // Copied out, since render() may run after the next scan dropped them.
+    // There's no cpu time to show before there's an interval to take it
+    // over.
+    _ncpu = elapsed > 0 ? _by_cpu.size() : 0;
+    for (size_t i = 0; i < _ncpu; ++i) {
+      memcpy(_cpu[i].comm, _by_cpu[i].comm, sizeof _cpu[i].comm);
+      _cpu[i].pct = int(100.0 * _by_cpu[i].delta / _hz / elapsed + 0.5);
+    }
+    _nmem = _by_rss.size();
+    for (size_t i = 0; i < _nmem; ++i) {
+      memcpy(_mem[i].comm, _by_rss[i].comm, sizeof _mem[i].comm);
+      _mem[i].rss_kb = _by_rss[i].rss_kb;
+    }
+  }
+
+  size_t processes() const { return _procs.size(); }
+
+  // Nobody is hogging a cpu.
+  bool steady() const {
+    return _ncpu == 0 || _cpu[0].pct <= Cpuinfo::busy();
+  }
+
+  enum Color color() const {
+    return NORMAL;
+  }
+  void render(Writer &w) const {
+    for (size_t i = 0; i < _ncpu; ++i) {
+      ColorScope cs(w, grade(_cpu[i].pct, config().cpu));
+      w << _cpu[i].comm << ' ' << _cpu[i].pct << "% ";
+    }
+    for (size_t i = 0; i < _nmem; ++i) {
+      w << _mem[i].comm << ' ';
+      Meminfo::size(w, _mem[i].rss_kb);
+    }
+  }
+};
+
+// Read and write throughput and busy time of each whole disk, from
+// /proc/diskstats.  The disks are what /sys/block lists, less the ones
+// backed by memory or files (ram, zram, loop) and the stacked ones (dm,
+// md) whose I/O already shows on the disks underneath.
+class Disk : public Metric {
+  // Sectors read and written, and milliseconds spent doing I/O.
+  enum Column {
+    READ,
+    WRITTEN,
+    BUSY,
+  };
+
+  File f;
+  std::vector<std::string> _names;
+  DeltaCounter<3> _counters;
+
+  static bool _virtual(const char *name) {
+    static const char *const prefixes[] = {"loop", "ram", "zram", "dm-", "md"};
+    for (const char *prefix : prefixes) {
+      if (strncmp(name, prefix, strlen(prefix)) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void _discover() {
+    _names.clear();
+    const std::string block = "/sys/block";
+    if (dir_exists(sysroot() + block)) {
+      Dir dir((sysroot() + block).c_str());
+      while (const char *name = dir.next()) {
+        if (_virtual(name)) {
+          continue;
+        }
+        // Card readers and empty optical drives are there with no medium.
+        const std::string size = read_line(block + "/" + name + "/size");
+        if (!size.empty() && size != "0") {
+          _names.push_back(name);
+        }
+      }
+    }
+    std::sort(_names.begin(), _names.end());
+  }
+
+  int _index_of(const char *name, size_t len) const {
+    for (size_t i = 0; i < _names.size(); ++i) {
+      if (_names[i].size() == len && memcmp(_names[i].data(), name, len) == 0) {
+        return int(i);
+      }
+    }
+    return -1;
+  }
+
+  // Bytes per second as "1.2M" or "300.0k".
+  static void _rate(Writer &w, double bytes) {
+    const double kb = bytes / 1024.0;
+    if (kb > (1<<10)) {
+      w.fixed(kb / (1<<10), 1) << "M";
+    } else {
+      w.fixed(kb, 1) << "k";
+    }
+  }
+
+public:
+  static const char *name() { return "Disk"; }
+  static std::chrono::milliseconds interval() { return std::chrono::seconds(5); }
+
+  Disk() : f("/proc/diskstats", 1<<14) {
+    discover();
+  }
+
+  // Looks at /sys/block again, after a disk or medium came or went.  The
+  // rates start over if the set of disks changed.
+  void discover() {
+    const std::vector<std::string> old = _names;
+    _discover();
+    if (_names != old || _counters.size() != _names.size()) {
+      _counters.resize(_names.size());
+      sample();
+    }
+  }
+
+  void sample() {
+    _counters.next();
+    uint64_t *sectors_read = _counters.column(READ),
+      *sectors_written = _counters.column(WRITTEN), *io_ms = _counters.column(BUSY);
+    if (_names.empty() || !f.read()) {
+      return;
+    }
+    for (const char *p = f.data(); *p; p = next_line(p)) {
+      parse_size(p);  // major
+      parse_size(p);  // minor
+      while (*p == ' ') {
+        ++p;
+      }
+      const size_t len = strcspn(p, " \n");
+      const int i = _index_of(p, len);
+      if (i < 0) {
+        continue;
+      }
+      p += len;
+      for (int field = 0; field < 10; ++field) {
+        const size_t v = parse_size(p);
+        if (field == 2) {
+          sectors_read[i] = v;
+        } else if (field == 6) {
+          sectors_written[i] = v;
+        } else if (field == 9) {
+          io_ms[i] = v;
+        }
+      }
+    }
+  }
+
+  bool present() const { return !_names.empty(); }
+  size_t size() const { return _names.size(); }
+  const std::string &disk(size_t i) const { return _names[i]; }
+  double read_rate(size_t i) const { return 512 * _counters.rate(READ, i); }
+  double write_rate(size_t i) const { return 512 * _counters.rate(WRITTEN, i); }
+  int busy(size_t i) const {
+    return int(std::min(100.0, _counters.rate(BUSY, i) / 10.0));
+  }
+
+  // No disk is more than lightly used.
+  bool steady() const {
+    for (size_t i = 0; i < size(); ++i) {
+      if (busy(i) > 10) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  Color color() const { return NORMAL; }
+  void render(Writer &w) const {
+    for (size_t i = 0; i < size(); ++i) {
+      w << _names[i] << ' ';
+      _rate(w, read_rate(i));
+      w << ' ';
+      _rate(w, write_rate(i));
+      w << ' ';
+      ColorScope cs(w, grade(busy(i), config().disk));
+      w << busy(i) << "% ";
+    }
+  }
+};
+
+// Pressure stall information: the share of the last interval in which
+// some task was stalled waiting on cpu, memory or io, and in which all of
+// them were at once.  The kernel's avg10 trails a 5s interval, so this
+// works from the total= stall time instead.
+class Pressure : public Metric {
+public:
+  enum Resource {
+    CPU,
+    MEMORY,
+    IO,
+  };
+
+private:
+  // Microseconds stalled.
+  enum Column {
+    SOME,
+    FULL,
+  };
+
+  std::unique_ptr<File> _files[3];
+  DeltaCounter<2> _counters;
+  bool _present;
+
+  static enum Color color_for(double pct) {
+    return grade(pct, config().psi);
+  }
+
+public:
+  static const char *name() { return "Pressure"; }
+  static std::chrono::milliseconds interval() { return std::chrono::seconds(5); }
+
+  Pressure() : _counters(3), _present(false) {
+    static const char *const paths[] = {
+      "/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io"
+    };
+    for (int r = 0; r < 3; ++r) {
+      _files[r].reset(new File(paths[r], 256));
+    }
+    sample();
+  }
+
+  void sample() {
+    _counters.next();
+    uint64_t *some = _counters.column(SOME), *full = _counters.column(FULL);
+    _present = false;
+    for (int r = 0; r < 3; ++r) {
+      if (!_files[r]->read()) {
+        continue;
+      }
+      _present = true;
+      for (const char *p = _files[r]->data(); *p; p = next_line(p)) {
+        const bool is_full = strncmp(p, "full ", 5) == 0;
+        if (!is_full && strncmp(p, "some ", 5) != 0) {
+          continue;
+        }
+        const char *total = strstr(p, "total=");
+        if (total && total < next_line(p)) {
+          total += 6;
+          (is_full ? full : some)[r] = parse_size(total);
+        }
+      }
+    }
+  }
+
+  // Kernels without CONFIG_PSI, or booted with psi=0, have no files.
+  bool present() const { return _present; }
+
+  // Percent of the last interval.
+  double some(Resource r) const { return std::min(100.0, _counters.rate(SOME, r) / 1e4); }
+  double full(Resource r) const { return std::min(100.0, _counters.rate(FULL, r) / 1e4); }
+
+  bool steady() const {
+    return some(CPU) < 1 && some(MEMORY) < 1 && some(IO) < 1;
+  }
+
+  Color color() const { return NORMAL; }
+  void render(Writer &w) const {
+    static const char *const labels[] = {"c ", "m ", "i "};
+    w << "psi ";
+    for (int r = 0; r < 3; ++r) {
+      ColorScope cs(w, color_for(some(Resource(r))));
+      w << labels[r];
+      w.fixed(some(Resource(r)), 1) << ' ';
+    }
+  }
+};
+
+// Every thermal zone and hwmon temperature sensor on the machine, found
+// at startup and whenever a uevent says one came or went, and otherwise
+// re-read through their open files.
+class Temp : public Metric {
+public:
+  enum Aggregate {
+    MAX,      // hottest sensor
+    MEAN,     // average of all sensors
+    PACKAGE,  // each cpu package on its own
+  };
+
+private:
+  struct Sensor {
+    std::unique_ptr<File> f;
+    bool package;
+    bool ok;
+    double celsius;
+  };
+
+  const Aggregate _aggregate;
+  const bool _bars;
+  std::vector<Sensor> _sensors;
+  double temp, _last;
+
+  void _add(const std::string &path, bool package) {
+    Sensor s{std::unique_ptr<File>(new File(path, 64)), package, false, 0};
+    if (s.f->read()) {
+      _sensors.push_back(std::move(s));
+    }
+  }
+
+  void _discover() {
+    _sensors.clear();
+    const std::string thermal = "/sys/class/thermal";
+    if (dir_exists(sysroot() + thermal)) {
+      Dir dir((sysroot() + thermal).c_str());
+      while (const char *name = dir.next()) {
+        if (strncmp(name, "thermal_zone", 12) != 0) {
+          continue;
+        }
+        const std::string zone = thermal + "/" + name;
+        _add(zone + "/temp", read_line(zone + "/type") == "x86_pkg_temp");
+      }
+    }
+    const std::string hwmon = "/sys/class/hwmon";
+    if (dir_exists(sysroot() + hwmon)) {
+      Dir dir((sysroot() + hwmon).c_str());
+      while (const char *name = dir.next()) {
+        const std::string hw = hwmon + "/" + name;
+        if (!dir_exists(sysroot() + hw)) {
+          continue;
+        }
+        Dir inputs((sysroot() + hw).c_str());
+        while (const char *input = inputs.next()) {
+          const size_t len = strlen(input);
+          if (strncmp(input, "temp", 4) != 0 || len < 6 ||
+              strcmp(input + len - 6, "_input") != 0) {
+            continue;
+          }
+          const std::string prefix = hw + "/" + std::string(input, len - 6);
+          const std::string label = read_line(prefix + "_label");
+          // coretemp calls it "Package id N", k10temp "Tctl"/"Tdie".
+          _add(hw + "/" + input,
+               label.compare(0, 10, "Package id") == 0 || label == "Tctl" || label == "Tdie");
+        }
+      }
+    }
+    // Keep a stable order no matter what readdir gave us.
+    std::sort(_sensors.begin(), _sensors.end(), [](const Sensor &a, const Sensor &b) {
+        return a.f->path() < b.f->path();
+      });
+  }
+
+  bool _have_packages() const {
+    return std::any_of(_sensors.begin(), _sensors.end(),
+                       [](const Sensor &s) { return s.ok && s.package; });
+  }
+
+  static enum Color color_for(double t) {
+    return grade(t, config().temp);
+  }
+
+public:
+  static const char *name() { return "Temp"; }
+  static std::chrono::milliseconds interval() { return std::chrono::seconds(15); }
+
+  Temp(Aggregate aggregate = MAX, bool bars = false)
+    : _aggregate(aggregate), _bars(bars), temp(0), _last(0) {
+    _discover();
+    sample();
+  }
+
+  void sample() {
+    _last = temp;
+    double sum = 0, max = 0;
+    int n = 0;
+    for (auto &s : _sensors) {
+      // Sensors that fail to read (a zone that went away, an I2C chip that
+      // isn't answering) are left out instead of counting as 0C.
+      s.ok = s.f->read();
+      if (!s.ok) {
+        continue;
+      }
+      s.celsius = strtod(s.f->data(), NULL) / 1000.0;
+      sum += s.celsius;
+      max = (n == 0) ? s.celsius : std::max(max, s.celsius);
+      ++n;
+    }
+    temp = (_aggregate == MEAN && n) ? sum / n : max;
+  }
+
+  void discover() {
+    _discover();
+    sample();
+  }
+
+  double celsius() const { return temp; }
+
+  // Moved by less than a couple of degrees since the last sample.
+  bool steady() const { return std::abs(temp - _last) < 2.0; }
+
+  enum Color color() const {
+    return color_for(temp);
+  }
+
+  void render(Writer &w) const {
+    if (_aggregate == PACKAGE && _have_packages()) {
+      bool first = true;
+      for (const auto &s : _sensors) {
+        if (s.ok && s.package) {
+          if (!first) {
+            w << '/';
+          }
+          first = false;
+          w.fixed(s.celsius, 1);
+        }
+      }
+      w << 'C';
+    } else {
+      w.fixed(temp, 1) << 'C';
+    }
+    if (_bars) {
+      for (const auto &s : _sensors) {
+        if (s.ok) {
+          const int h = std::max(1, std::min(12, int(12 * s.celsius / 100.0)));
+          w << Bar(0, 13 - h, 2, h, 3, true, color_for(s.celsius));
+        }
+      }
+    }
+  }
+};
+
+class Battery : public Metric {
+  // One /sys/class/power_supply entry, read through its uevent file so a
+  // sample is a single pread() no matter how many attributes we want.
+  class Supply {
+    const std::string _dir;
+    File _uevent;
+
+  public:
+    // Chargers are whatever isn't a battery: Mains, USB, Wireless.
+    // Batteries in a mouse or headset are scoped to that device.
+    bool battery, device;
+    bool present, online, charging;
+    ssize_t energy_now, energy_full, power_now;  // uWh, uW
+
+    Supply(const std::string &dir)
+      : _dir(dir),
+        _uevent(dir + "/uevent", 2048),
+        battery(false),
+        device(false),
+        present(false),
+        online(false),
+        charging(false),
+        energy_now(0),
+        energy_full(0),
+        power_now(0)
+    {}
+
+    const std::string &dir() const { return _dir; }
+
+    // Returns false if the supply isn't there.
+    bool sample() {
+      present = online = charging = false;
+      energy_now = energy_full = power_now = 0;
+      if (!_uevent.read()) {
+        return false;
+      }
+
+      // Batteries report either energy_* and power_now, or charge_* and
+      // current_now, which we convert using voltage_now.
+      ssize_t charge_now = -1, charge_full = -1, current_now = -1, voltage_now = -1;
+      bool has_present = false, has_energy = false, has_power = false;
+      static const char prefix[] = "POWER_SUPPLY_";
+      for (const char *p = _uevent.data(); *p; p = next_line(p)) {
+        if (strncmp(p, prefix, sizeof prefix - 1) != 0) {
+          continue;
+        }
+        const char *key = p + sizeof prefix - 1;
+        const char *eq = strchr(key, '=');
+        if (!eq) {
+          continue;
+        }
+        const size_t keylen = eq - key;
+        const char *val = eq + 1;
+        if (key_is(key, keylen, "TYPE")) {
+          battery = strncmp(val, "Battery", 7) == 0;
+        } else if (key_is(key, keylen, "SCOPE")) {
+          device = strncmp(val, "Device", 6) == 0;
+        } else if (key_is(key, keylen, "PRESENT")) {
+          has_present = true;
+          present = atoi(val) != 0;
+        } else if (key_is(key, keylen, "ONLINE")) {
+          online = atoi(val) != 0;
+        } else if (key_is(key, keylen, "STATUS")) {
+          charging = strncmp(val, "Charging", 8) == 0;
+        } else if (key_is(key, keylen, "ENERGY_NOW")) {
+          has_energy = true;
+          energy_now = strtoll(val, NULL, 10);
+        } else if (key_is(key, keylen, "ENERGY_FULL")) {
+          energy_full = strtoll(val, NULL, 10);
+        } else if (key_is(key, keylen, "POWER_NOW")) {
+          has_power = true;
+          power_now = llabs(strtoll(val, NULL, 10));
+        } else if (key_is(key, keylen, "CHARGE_NOW")) {
+          charge_now = strtoll(val, NULL, 10);
+        } else if (key_is(key, keylen, "CHARGE_FULL")) {
+          charge_full = strtoll(val, NULL, 10);
+        } else if (key_is(key, keylen, "CURRENT_NOW")) {
+          current_now = llabs(strtoll(val, NULL, 10));
+        } else if (key_is(key, keylen, "VOLTAGE_NOW")) {
+          voltage_now = strtoll(val, NULL, 10);
+        }
+      }
+      if (!has_present) {
+        present = true;
+      }
+      // uAh * uV / 10^6 = uWh.  Without a voltage we stay in charge units,
+      // which is still consistent for a single battery.
+      const double volts = voltage_now > 0 ? voltage_now / 1e6 : 1.0;
+      if (!has_energy && charge_now >= 0) {
+        energy_now = ssize_t(charge_now * volts);
+        energy_full = ssize_t(std::max<ssize_t>(charge_full, 0) * volts);
+      }
+      if (!has_power && current_now >= 0) {
+        power_now = ssize_t(current_now * volts);
+      }
+      return true;
+    }
+  };
+
+  std::vector<std::unique_ptr<Supply>> _batteries, _chargers;
+  int _percent, _minutes;
+  bool _present;
+  char _direction;
+  bool _steady;
+
+public:
+  static const char *name() { return "Battery"; }
+  static std::chrono::milliseconds interval() { return std::chrono::seconds(30); }
+  Battery() : _percent(0), _minutes(0), _present(false), _direction('!'), _steady(false) {
+    discover();
+    sample();
+  }
+
+  // Sorts /sys/class/power_supply into batteries and chargers, keeping
+  // the supplies it already had open.  Run again when a uevent says
+  // one came or went.
+  void discover() {
+    std::vector<std::unique_ptr<Supply>> all;
+    for (auto *v : {&_batteries, &_chargers}) {
+      std::move(v->begin(), v->end(), std::back_inserter(all));
+      v->clear();
+    }
+    const std::string supplies = "/sys/class/power_supply";
+    std::vector<std::string> names;
+    if (dir_exists(sysroot() + supplies)) {
+      Dir dir((sysroot() + supplies).c_str());
+      while (const char *name = dir.next()) {
+        names.push_back(name);
+      }
+    }
+    std::sort(names.begin(), names.end());
+    for (const auto &name : names) {
+      const std::string path = supplies + "/" + name;
+      auto it = std::find_if(all.begin(), all.end(), [&path](const std::unique_ptr<Supply> &s) {
+          return s && s->dir() == path;
+        });
+      std::unique_ptr<Supply> s(it != all.end() ? std::move(*it) : nullptr);
+      if (!s) {
+        s.reset(new Supply(path));
+        if (!s->sample()) {
+          continue;
+        }
+      }
+      if (!s->device) {
+        (s->battery ? _batteries : _chargers).push_back(std::move(s));
+      }
+    }
+  }
+
+  void sample() {
+    const int last_percent = _percent;
+    const bool last_present = _present;
+    const char last_direction = _direction;
+    _percent = _minutes = 0;
+    _present = false;
+    _direction = '!';
+    sample_supplies();
+    _steady = _present == last_present && _direction == last_direction &&
+      _percent == last_percent;
+  }
+
+private:
+  void sample_supplies() {
+    ssize_t power = 0, energy_full = 0, energy_now = 0;
+    bool charging = false;
+    for (auto &sb : _batteries) {
+      if (sb->sample() && sb->present) {
+        _present = true;
+        power += sb->power_now;
+        energy_full += sb->energy_full;
+        energy_now += sb->energy_now;
+        charging = charging || sb->charging;
+      }
+    }
+    if (!_present) {
+      return;
+    }
+
+    // Without a charger, trust the batteries' own status.
+    bool have_charger = false, ac_present = false;
+    for (auto &c : _chargers) {
+      if (c->sample()) {
+        have_charger = true;
+        ac_present = ac_present || c->online;
+      }
+    }
+    if (!have_charger) {
+      ac_present = charging;
+    }
+
+    double dpercent = energy_full > 0 ? 100.0 * energy_now / energy_full : 0;
+    if (100.0 - dpercent < 0.5) {
+      _percent = 100;
+    } else {
+      _percent = int(dpercent);
+    }
+    if (ac_present) {
+      if (_percent == 100) {
+        _direction = '=';
+        _minutes = 0;
+      } else {
+        _direction = '+';
+        _minutes = power > 0 ? int(60.0 * (energy_full - energy_now) / power) : 0;
+      }
+    } else {
+      _direction = '-';
+      _minutes = power > 0 ? int(60.0 * energy_now / power) : 0;
+    }
+    if (_minutes < 0) {
+      _minutes = 0;
+    }
+  }
+
+public:
+  bool present() const { return _present; }
+  int percent() const { return _percent; }
+  int minutes() const { return _minutes; }
+  char direction() const { return _direction; }
+  bool discharging() const { return _present && _direction == '-'; }
+
+  // Presence, direction and percentage are what they were last sample.
+  bool steady() const { return _steady; }
+
+  enum Color color() const {
+    const Grades &g = config().battery;
+    return ((_percent < g.red
+             ? RED
+             : ((_percent < g.orange)
+                ? ORANGE
+                : ((_percent < g.yellow)
+                   ? YELLOW
+                   : CYAN))));
+  }
+
+  void render(Writer &w) const {
+    w << _direction << _percent << "% ";
+    const int h = std::max(1, std::min(12, int(12 * _percent / 100.0)));
+    w << Bar(0, 13 - h, 3, h, 3, true, color());
+    if (_percent != 100 || _direction == '-') {
+      w.num(_minutes / 60) << ":";
+      w.num(_minutes % 60, 2);
+    }
+  }
+};
+
+// Only shows minutes, so main() redraws it from a MinuteTimer.  The
+// timezone is loaded once at startup by tzset().
+class Datetime : public Metric {
+public:
+  static const char *name() { return "Datetime"; }
+  enum Color color() const { return NORMAL; }
+  void render(Writer &w) const {
+    char buf[65];
+    time_t result = Trace::wall_time();
+    struct tm resulttm;
+    if (!localtime_r(&result, &resulttm)) {
+      err(1, "localtime_r");
+    }
+    if(!strftime(buf, 64, "%a %b %d %H:%M", &resulttm)) {
+      err(1, "strftime");
+    }
+    w << buf;
+  }
+};
+
+class AlsaManager {
+  class MixerHandle {
+    snd_mixer_t *_h;
+  public:
+    MixerHandle() : _h(nullptr) {
+      if (snd_mixer_open(&_h, 0) != 0) {
+        _h = nullptr;
+      }
+    }
+    ~MixerHandle() {
+      if (_h) {
+        snd_mixer_close(_h);
+      }
+    }
+    snd_mixer_t *get() const { return _h; }
+  };
+
+  class MixerSelemId {
+    snd_mixer_selem_id_t *_s;
+  public:
+    MixerSelemId(const char *mix_name, int mix_index) : _s(nullptr) {
+      snd_mixer_selem_id_malloc(&_s);
+      snd_mixer_selem_id_set_index(_s, mix_index);
+      snd_mixer_selem_id_set_name(_s, mix_name);
+    }
+    ~MixerSelemId() {
+      snd_mixer_selem_id_free(_s);
+    }
+    snd_mixer_selem_id_t *get() const { return _s; }
+  };
+
+  class MixerLoader {
+    snd_mixer_t *_handle;
+    bool _ok;
+  public:
+    MixerLoader(snd_mixer_t *handle) : _handle(handle), _ok(snd_mixer_load(handle) == 0) {}
+    ~MixerLoader() {
+      if (_ok) {
+        snd_mixer_free(_handle);
+      }
+    }
+    bool ok() const { return _ok; }
+  };
+
+  MixerHandle _handle;
+  std::unique_ptr<MixerLoader> _loader;
+  snd_mixer_elem_t *_elem;
+  std::vector<int> _fds;
+  long _volume;
+  bool _muted;
+  bool _ok;
+
+  // Re-reads the cached elem, returns true if anything changed.  A mixer
+  // that stops answering (the sound server went away) clears ok().
+  bool _read() {
+    long minv, maxv, lvol, rvol;
+    int lunmuted, runmuted;
+    if (snd_mixer_selem_get_playback_volume_range(_elem, &minv, &maxv) != 0 ||
+        snd_mixer_selem_get_playback_volume(_elem, SND_MIXER_SCHN_FRONT_LEFT, &lvol) != 0 ||
+        snd_mixer_selem_get_playback_volume(_elem, SND_MIXER_SCHN_FRONT_RIGHT, &rvol) != 0 ||
+        snd_mixer_selem_get_playback_switch(_elem, SND_MIXER_SCHN_FRONT_LEFT, &lunmuted) != 0 ||
+        snd_mixer_selem_get_playback_switch(_elem, SND_MIXER_SCHN_FRONT_RIGHT, &runmuted) != 0) {
+      _ok = false;
+      return false;
+    }
+    long vol = (lvol + rvol) / 2;
+
+    const long volume = maxv > minv ? long(100.0 * (vol - minv) / (maxv - minv)) : 0;
+    const bool muted = lunmuted == 0 && runmuted == 0;
+    const bool changed = volume != _volume || muted != _muted;
+    _volume = volume;
+    _muted = muted;
+    return changed;
+  }
+
+public:
+  // The mixer is loaded once and kept loaded; changes arrive as events on
+  // fds(), which the caller polls and hands to handle_events().  At login
+  // the sound server may not be up yet, so failing to open is not fatal:
+  // check ok() and try again later with a new AlsaManager.
+  AlsaManager(const char *card = "default", const char *mix_name = "Master")
+    : _handle(), _elem(nullptr), _volume(0), _muted(false), _ok(false) {
+    if (!_handle.get() ||
+        snd_mixer_attach(_handle.get(), card) != 0 ||
+        snd_mixer_selem_register(_handle.get(), NULL, NULL) != 0) {
+      return;
+    }
+    _loader.reset(new MixerLoader(_handle.get()));
+    if (!_loader->ok()) {
+      return;
+    }
+
+    static int mix_index = 0;
+    MixerSelemId sid(mix_name, mix_index);
+    if (!(_elem = snd_mixer_find_selem(_handle.get(), sid.get()))) {
+      return;
+    }
+    int n = snd_mixer_poll_descriptors_count(_handle.get());
+    if (n < 0) {
+      return;
+    }
+    std::vector<struct pollfd> pfds(n);
+    if (snd_mixer_poll_descriptors(_handle.get(), pfds.data(), n) < 0) {
+      return;
+    }
+    for (const auto &pfd : pfds) {
+      _fds.push_back(pfd.fd);
+    }
+    _ok = true;
+    _read();
+  }
+
+  bool ok() const { return _ok; }
+
+  class AlsaMetric : public Metric {
+    long _volume;
+    bool _muted;
+  public:
+    static const char *name() { return "Alsa"; }
+    AlsaMetric(long volume = 0, bool muted = false) : _volume(volume), _muted(muted) {}
+
+    long volume() const { return _volume; }
+    bool muted() const { return _muted; }
+
+    enum Color color() const { return NORMAL; }
+    void render(Writer &w) const {
+      w << " v ";
+      const long v = _muted ? 0 : _volume;
+      const int h = std::max(0, std::min(12, int(12 * v / 100.0)));
+      w << Bar(0, 13 - h, 5, h, 5, true, CYAN);
+    }
+  };
+
+  const std::vector<int> &fds() const { return _fds; }
+
+  // Drains pending mixer events.  Returns true if the volume or mute state
+  // changed; on false, check ok() to tell a quiet mixer from a dead one.
+  bool handle_events() {
+    if (snd_mixer_handle_events(_handle.get()) < 0) {
+      _ok = false;
+      return false;
+    }
+    return _read();
+  }
+
+  // The mixer state, plain enough to hand to another thread.
+  struct Snapshot {
+    long volume;
+    bool muted;
+    bool present;
+  };
+
+  Snapshot snapshot() const {
+    return Snapshot{_volume, _muted, _ok};
+  }
+
+  AlsaMetric get_volume() const {
+    return AlsaMetric(_volume, _muted);
+  }
+};
+
+class Wifi {
+public:
+  enum State {
+    DISCONNECTED = 0,
+    SEARCHING,
+    CONNECTING,
+    CONNECTED,
+    WIFI_OFF
+  };
+
+  // What we display, copied out of the Wifi object so it can be handed to
+  // another thread.
+  struct Snapshot {
+    bool present;
+    enum State state;
+    char ssid[4 * 32 + 1];  // wpa_supplicant escapes non-printables as \xNN
+  };
+
+  class WifiMetric : public Metric {
+    Snapshot _s;
+  public:
+    static const char *name() { return "Wifi"; }
+    WifiMetric() : _s{false, WIFI_OFF, ""} {}
+    explicit WifiMetric(const Snapshot &s) : _s(s) {}
+
+    enum Color color() const {
+      switch (_s.state) {
+      case WIFI_OFF:
+        return RED;
+      case DISCONNECTED:
+        return ORANGE;
+      case SEARCHING:
+        return YELLOW;
+      case CONNECTING:
+        return GREEN;
+      case CONNECTED:
+        return BLUE;
+      }
+      return NORMAL;
+    }
+
+    void render(Writer &w) const {
+      if (_s.state == WIFI_OFF) {
+        w << "wifi off";
+      } else if (!_s.ssid[0]) {
+        w << "???";
+      } else {
+        w << _s.ssid;
+      }
+    }
+  };
+
+private:
+  class WpaCtrl {
+    struct wpa_ctrl *_c;
+  public:
+    WpaCtrl(const char *sock) : _c(wpa_ctrl_open(sock)) {}
+    ~WpaCtrl() {
+      if (_c != NULL) {
+        wpa_ctrl_close(_c);
+      }
+    }
+    WpaCtrl(const WpaCtrl &) = delete;
+    WpaCtrl &operator=(const WpaCtrl &) = delete;
+
+    bool ok() const {
+      return _c != NULL;
+    }
+
+    int fd() const {
+      return wpa_ctrl_get_fd(_c);
+    }
+
+    bool attach() {
+      return wpa_ctrl_attach(_c) == 0;
+    }
+
+    bool pending() {
+      return wpa_ctrl_pending(_c) > 0;
+    }
+
+    // Receives one unsolicited message, NUL-terminated.  Returns false if
+    // the connection is gone.
+    bool recv(char *buf, size_t bufsz) {
+      size_t len = bufsz - 1;
+      if (wpa_ctrl_recv(_c, buf, &len) != 0) {
+        return false;
+      }
+      buf[len] = '\0';
+      return true;
+    }
+
+    bool status(std::string &ssid, enum State &state) {
+      char buf[1<<12];
+      size_t bufsz = sizeof buf - 1;
+      int ret = wpa_ctrl_request(_c, "STATUS", (sizeof "STATUS") - 1, buf, &bufsz, NULL);
+      if (ret != 0) {
+        return false;
+      }
+      buf[bufsz] = '\0';
+
+      for (const char *p = buf; *p; p = next_line(p)) {
+        const size_t len = strcspn(p, "\n");
+        if (strncmp(p, "ssid=", 5) == 0) {
+          ssid.assign(p + 5, len - 5);
+        } else if (strncmp(p, "wpa_state=", 10) == 0) {
+          state = parse_state(std::string(p + 10, len - 10));
+        }
+      }
+      return true;
+    }
+  };
+
+  static enum State parse_state(const std::string &statestr) {
+    if (statestr == "COMPLETED") {
+      return CONNECTED;
+    } else if (statestr == "DISCONNECTED" || statestr == "INACTIVE") {
+      return DISCONNECTED;
+    } else if (statestr == "SCANNING") {
+      return SEARCHING;
+    } else if (statestr == "INTERFACE_DISABLED") {
+      return WIFI_OFF;
+    } else {
+      return CONNECTING;
+    }
+  }
+
+  // One wpa_supplicant control socket.  `_ctrl' is only used for the
+  // initial STATUS request, after that we follow the unsolicited events on
+  // the attached `_monitor' connection.
+  class Interface {
+    WpaCtrl _ctrl, _monitor;
+    bool _ok;
+
+  public:
+    const std::string path;
+    std::string ssid;
+    enum State state;
+
+    Interface(const std::string &sockpath)
+      : _ctrl(sockpath.c_str()),
+        _monitor(sockpath.c_str()),
+        _ok(false),
+        path(sockpath),
+        ssid(""),
+        state(WIFI_OFF) {
+      _ok = (_ctrl.ok() && _monitor.ok() && _monitor.attach() &&
+             _ctrl.status(ssid, state));
+    }
+
+    bool ok() const { return _ok; }
+    int fd() const { return _monitor.fd(); }
+
+    // Applies all pending events.  Returns false if wpa_supplicant went
+    // away; `changed' is set if the state or ssid moved.
+    bool handle_events(bool &changed) {
+      const std::string old_ssid = ssid;
+      const enum State old_state = state;
+      while (_monitor.pending()) {
+        char buf[1<<11];
+        if (!_monitor.recv(buf, sizeof buf)) {
+          return false;
+        }
+        // Strip the "<level>" prefix.
+        const char *msg = buf;
+        if (*msg == '<') {
+          msg += strcspn(msg, ">");
+          if (*msg) {
+            ++msg;
+          }
+        }
+        if (strncmp(msg, WPA_EVENT_TERMINATING, strlen(WPA_EVENT_TERMINATING)) == 0) {
+          return false;
+        } else if (strncmp(msg, WPA_EVENT_CONNECTED, strlen(WPA_EVENT_CONNECTED)) == 0) {
+          state = CONNECTED;
+        } else if (strncmp(msg, WPA_EVENT_DISCONNECTED, strlen(WPA_EVENT_DISCONNECTED)) == 0) {
+          state = DISCONNECTED;
+          ssid.clear();
+        } else if (strncmp(msg, WPA_EVENT_SCAN_STARTED, strlen(WPA_EVENT_SCAN_STARTED)) == 0) {
+          // Background scans happen while associated too.
+          if (state != CONNECTED) {
+            state = SEARCHING;
+          }
+        } else if (strncmp(msg, "Trying to associate with ", 25) == 0) {
+          // "Trying to associate with <bssid> (SSID='<ssid>' freq=...)"
+          // is the only place the ssid shows up before CONNECTED.
+          const char *p = strstr(msg, "SSID='");
+          if (p) {
+            p += 6;
+            const char *e = strstr(p, "' freq=");
+            ssid.assign(p, e ? e - p : strlen(p));
+          }
+          state = CONNECTING;
+        }
+      }
+      changed = changed || state != old_state || ssid != old_ssid;
+      return true;
+    }
+  };
+
+  EventLoop &_loop;
+  const std::function<bool()> _on_change;
+  std::vector<std::unique_ptr<Interface>> _ifaces;
+  // Watches /run for wpa_supplicant's directory and the directory for
+  // its sockets, so we attach as soon as one is bound.
+  int _inotify;
+
+  void _watch_sockets() {
+    inotify_add_watch(_inotify, "/run/wpa_supplicant", IN_CREATE | IN_MOVED_TO);
+  }
+
+  bool _handle_inotify() {
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t n;
+    while ((n = read(_inotify, buf, sizeof buf)) > 0) {
+      for (const char *p = buf; p < buf + n;) {
+        const struct inotify_event *ev = reinterpret_cast<const struct inotify_event *>(p);
+        if (ev->len && strcmp(ev->name, "wpa_supplicant") == 0) {
+          _watch_sockets();
+        }
+        p += sizeof *ev + ev->len;
+      }
+    }
+    return discover() && _on_change();
+  }
+
+  const Interface *_current() const {
+    for (const auto &iface : _ifaces) {
+      if (iface->state == CONNECTED) {
+        return iface.get();
+      }
+    }
+    return _ifaces.empty() ? nullptr : _ifaces.front().get();
+  }
+
+  bool _handle_events(Interface *iface) {
+    bool changed = false;
+    if (!iface->handle_events(changed)) {
+      _loop.unwatch(iface->fd());
+      _ifaces.erase(std::find_if(_ifaces.begin(), _ifaces.end(),
+                                 [iface](const std::unique_ptr<Interface> &i) {
+                                   return i.get() == iface;
+                                 }));
+      changed = true;
+    }
+    return changed && _on_change();
+  }
+
+public:
+  static std::chrono::milliseconds interval() { return std::chrono::seconds(30); }
+
+  // Monitor connections are registered with loop, and on_change is called
+  // whenever an event changes what we'd display.
+  Wifi(EventLoop &loop, std::function<bool()> on_change)
+    : _loop(loop), _on_change(on_change), _inotify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+    if (_inotify >= 0 &&
+        inotify_add_watch(_inotify, "/run", IN_CREATE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+      close(_inotify);
+      _inotify = -1;
+    }
+    if (_inotify >= 0) {
+      _watch_sockets();
+      _loop.watch(_inotify, [this]() { return _handle_inotify(); });
+    }
+    discover();
+  }
+  ~Wifi() {
+    for (const auto &iface : _ifaces) {
+      _loop.unwatch(iface->fd());
+    }
+    if (_inotify >= 0) {
+      _loop.unwatch(_inotify);
+      close(_inotify);
+    }
+  }
+  Wifi(const Wifi &) = delete;
+  Wifi &operator=(const Wifi &) = delete;
+
+  // Whether discover() runs on its own when a socket shows up.  If not,
+  // the caller has to keep calling it.
+  bool watching() const { return _inotify >= 0; }
+
+  // Connects to any control sockets we aren't attached to yet, such as
+  // after wpa_supplicant restarts.  Returns true if something new showed
+  // up.
+  bool discover() {
+    if (!dir_exists("/run/wpa_supplicant")) {
+      return false;
+    }
+    bool found = false;
+    Dir dir("/run/wpa_supplicant");
+    while (const char *name = dir.next()) {
+      const std::string path = std::string("/run/wpa_supplicant/") + name;
+      if (std::any_of(_ifaces.begin(), _ifaces.end(),
+                      [&path](const std::unique_ptr<Interface> &i) {
+                        return i->path == path;
+                      })) {
+        continue;
+      }
+      std::unique_ptr<Interface> iface(new Interface(path));
+      if (!iface->ok()) {
+        continue;
+      }
+      Interface *ip = iface.get();
+      _loop.watch(ip->fd(), [this, ip]() { return _handle_events(ip); });
+      _ifaces.push_back(std::move(iface));
+      found = true;
+    }
+    return found;
+  }
+
+  Snapshot snapshot() const {
+    Snapshot snap;
+    const Interface *iface = _current();
+    snap.present = iface != nullptr;
+    snap.state = iface ? iface->state : WIFI_OFF;
+    const size_t n = iface ? std::min(iface->ssid.size(), sizeof snap.ssid - 1) : 0;
+    if (n) {
+      memcpy(snap.ssid, iface->ssid.data(), n);
+    }
+    snap.ssid[n] = '\0';
+    return snap;
+  }
+
+  bool present() const { return !_ifaces.empty(); }
+};
+
+// The rx/tx history of one network interface.
+class Link : public Metric {
+  struct Counters {
+    size_t rx, tx;
+  };
+  // About a minute of sparkline at the default 5s interval.
+  RingHistory<Counters, 57> _history;
+
+public:
+  // Bytes per second over the interval ending `age' samples ago.
+  double rx_rate(size_t age = 0) const {
+    return (_history[age].rx - _history[age + 1].rx) / _history.seconds(age);
+  }
+  double tx_rate(size_t age = 0) const {
+    return (_history[age].tx - _history[age + 1].tx) / _history.seconds(age);
+  }
+
+  bool have_rates() const {
+    return _history.size() >= 2 && _history.seconds(0) > 0;
+  }
+
+  const int ifindex;
+
+  void sample(size_t rx_bytes, size_t tx_bytes) {
+    _history.push(Counters{rx_bytes, tx_bytes});
+    if (!have_rates()) {
+      return;
+    }
+    const double max_rx = config().max_rx_mbit * (1<<20) / 8;
+    const double max_tx = config().max_tx_mbit * (1<<20) / 8;
+    const double rx = rx_rate(), tx = tx_rate();
+    const int rh = std::min(8, int(rx < (100<<10)
+                                   ? (3 * rx / (100<<10))
+                                   : (rx < (1<<20)
+                                      ? (3 + (3 * rx / (1<<20)))
+                                      : (6 + (2 * rx / max_rx)))));
+    const int th = std::min(4, int(tx < (10<<10)
+                                   ? (2 * tx / (10<<10))
+                                   : (2 + (2 * tx / max_tx))));
+    _history.encode({{std::make_pair(rh, GREEN), std::make_pair(th, RED)}});
+  }
+
+  // rx stands on row 7 and tx hangs from row 9 of the same columns.
+  explicit Link(int index)
+    : _history(std::array<Series, 2>{{Series{7, 1, 1, false}, Series{9, 1, 1, true}}}), ifindex(index) {}
+
+  // The latest rates are still in render()'s BLUE band.
+  bool steady() const {
+    return have_rates() && rx_rate() / 1024.0 <= config().rx.green &&
+      tx_rate() / 1024.0 <= config().tx.green;
+  }
+
+  Color color() const { return NORMAL; }
+  void render(Writer &w) const {
+    if (!have_rates()) {
+      return;
+    }
+
+    {
+      const double rx = rx_rate() / 1024.0;
+      const double tx = tx_rate() / 1024.0;
+      {
+        ColorScope cs(w, grade(rx, config().rx));
+        if (rx > (1<<10)) {
+          w.fixed(rx / (1<<10), 1) << "M";
+        } else {
+          w.fixed(rx, 1) << "k";
+        }
+      }
+      {
+        ColorScope cs(w, grade(tx, config().tx));
+        if (tx > (1<<10)) {
+          w.fixed(tx / (1<<10), 1) << "M";
+        } else {
+          w.fixed(tx, 1) << "k";
+        }
+      }
+    }
+    _history.render(w);
+  }
+};
+
+// A NETLINK_ROUTE socket.  Requests are answered synchronously; with
+// groups set, the socket is nonblocking and just collects notifications.
+class Rtnetlink {
+  struct LinkRequest {
+    struct nlmsghdr nh;
+    struct ifinfomsg ifi;
+  };
+
+  int _fd;
+  uint32_t _seq;
+  std::vector<LinkRequest> _reqs;
+  std::vector<char> _buf;
+
+  bool _send(const void *buf, size_t len) {
+    struct sockaddr_nl sa;
+    memset(&sa, 0, sizeof sa);
+    sa.nl_family = AF_NETLINK;
+    return sendto(_fd, buf, len, 0, (struct sockaddr *) &sa, sizeof sa) == ssize_t(len);
+  }
+
+  ssize_t _recv() {
+    ssize_t len;
+    while ((len = recv(_fd, &_buf[0], _buf.size(), 0)) < 0 && errno == EINTR) {}
+    return len;
+  }
+
+public:
+  explicit Rtnetlink(uint32_t groups = 0)
+    : _fd(socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | (groups ? SOCK_NONBLOCK : 0), NETLINK_ROUTE)),
+      _seq(0),
+      _buf(1<<15) {
+    if (_fd < 0) {
+      err(1, "socket(NETLINK_ROUTE)");
+    }
+    struct sockaddr_nl sa;
+    memset(&sa, 0, sizeof sa);
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = groups;
+    if (bind(_fd, (struct sockaddr *) &sa, sizeof sa) != 0) {
+      err(1, "bind(NETLINK_ROUTE)");
+    }
+    // The kernel always answers, but don't hang the bar if it somehow
+    // doesn't.
+    struct timeval tv = {1, 0};
+    setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  }
+  ~Rtnetlink() {
+    close(_fd);
+  }
+  Rtnetlink(const Rtnetlink &) = delete;
+  Rtnetlink &operator=(const Rtnetlink &) = delete;
+
+  int fd() const { return _fd; }
+
+  // Asks for the counters of just these interfaces, all in one datagram,
+  // and calls cb(ifindex, stats) for each answer.
+  template<class F>
+  void link_stats(const std::vector<int> &ifindexes, F cb) {
+    if (ifindexes.empty()) {
+      return;
+    }
+    _reqs.resize(ifindexes.size());
+    const uint32_t first = _seq + 1;
+    for (size_t k = 0; k < ifindexes.size(); ++k) {
+      LinkRequest &r = _reqs[k];
+      memset(&r, 0, sizeof r);
+      r.nh.nlmsg_len = NLMSG_LENGTH(sizeof r.ifi);
+      r.nh.nlmsg_type = RTM_GETLINK;
+      r.nh.nlmsg_flags = NLM_F_REQUEST;
+      r.nh.nlmsg_seq = ++_seq;
+      r.ifi.ifi_family = AF_UNSPEC;
+      r.ifi.ifi_index = ifindexes[k];
+    }
+    if (!_send(&_reqs[0], _reqs.size() * sizeof _reqs[0])) {
+      return;
+    }
+    for (size_t pending = ifindexes.size(); pending > 0;) {
+      ssize_t len = _recv();
+      if (len <= 0) {
+        return;
+      }
+      for (struct nlmsghdr *nh = (struct nlmsghdr *) &_buf[0];
+           NLMSG_OK(nh, (size_t) len);
+           nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_seq < first || nh->nlmsg_seq > _seq) {
+          // A late answer to a request that timed out.
+          continue;
+        }
+        --pending;
+        if (nh->nlmsg_type != RTM_NEWLINK) {
+          continue;
+        }
+        const struct ifinfomsg *ifi = (const struct ifinfomsg *) NLMSG_DATA(nh);
+        int alen = IFLA_PAYLOAD(nh);
+        for (const struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+          if (rta->rta_type == IFLA_STATS64) {
+            struct rtnl_link_stats64 st;
+            memset(&st, 0, sizeof st);
+            memcpy(&st, RTA_DATA(rta), std::min<size_t>(sizeof st, RTA_PAYLOAD(rta)));
+            cb(ifi->ifi_index, st);
+          }
+        }
+      }
+    }
+  }
+
+  // Returns the interface of the IPv4 default route with the best
+  // metric, or 0 if there isn't one.
+  int default_route() {
+    struct {
+      struct nlmsghdr nh;
+      struct rtmsg rt;
+    } req;
+    memset(&req, 0, sizeof req);
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof req.rt);
+    req.nh.nlmsg_type = RTM_GETROUTE;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nh.nlmsg_seq = ++_seq;
+    req.rt.rtm_family = AF_INET;
+    if (!_send(&req, sizeof req)) {
+      return 0;
+    }
+    int best = 0;
+    uint32_t best_metric = UINT32_MAX;
+    for (;;) {
+      ssize_t len = _recv();
+      if (len <= 0) {
+        return best;
+      }
+      for (struct nlmsghdr *nh = (struct nlmsghdr *) &_buf[0];
+           NLMSG_OK(nh, (size_t) len);
+           nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_seq != _seq) {
+          continue;
+        }
+        if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR) {
+          return best;
+        }
+        if (nh->nlmsg_type != RTM_NEWROUTE) {
+          continue;
+        }
+        const struct rtmsg *rt = (const struct rtmsg *) NLMSG_DATA(nh);
+        if (rt->rtm_dst_len != 0 || rt->rtm_type != RTN_UNICAST) {
+          continue;
+        }
+        uint32_t table = rt->rtm_table, metric = 0;
+        int oif = 0;
+        int alen = RTM_PAYLOAD(nh);
+        for (const struct rtattr *rta = RTM_RTA(rt); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+          if (rta->rta_type == RTA_OIF) {
+            oif = *(const int *) RTA_DATA(rta);
+          } else if (rta->rta_type == RTA_PRIORITY) {
+            metric = *(const uint32_t *) RTA_DATA(rta);
+          } else if (rta->rta_type == RTA_TABLE) {
+            table = *(const uint32_t *) RTA_DATA(rta);
+          }
+        }
+        if (table == RT_TABLE_MAIN && oif && metric < best_metric) {
+          best = oif;
+          best_metric = metric;
+        }
+      }
+    }
+  }
+
+  // Throws away queued notifications.  Returns true if there were any.
+  bool drain() {
+    bool any = false;
+    while (_recv() > 0) {
+      any = true;
+    }
+    return any;
+  }
+};
+
+// The kernel's uevents, so a battery in a dock, a late hwmon driver or a
+// USB disk shows up when it happens instead of by looking again every so
+// often.  fd() is -1 if the socket can't be had, as in some containers.
+class Uevents {
+  int _fd;
+  char _buf[1<<13];
+
+public:
+  Uevents()
+    : _fd(socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT)) {
+    struct sockaddr_nl sa;
+    memset(&sa, 0, sizeof sa);
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = 1;  // the kernel's own, not udev's rebroadcast
+    if (_fd < 0 || bind(_fd, (struct sockaddr *) &sa, sizeof sa) != 0) {
+      warn("NETLINK_KOBJECT_UEVENT");
+      if (_fd >= 0) {
+        close(_fd);
+      }
+      _fd = -1;
+    }
+  }
+  ~Uevents() {
+    if (_fd >= 0) {
+      close(_fd);
+    }
+  }
+  Uevents(const Uevents &) = delete;
+  Uevents &operator=(const Uevents &) = delete;
+
+  int fd() const { return _fd; }
+
+  // Calls cb(action, subsystem) for each queued event, and once with both
+  // empty if the socket overflowed and events were lost, for the caller
+  // to look at everything again.
+  template<class F>
+  void handle_events(F cb) {
+    for (;;) {
+      struct sockaddr_nl sa;
+      socklen_t salen = sizeof sa;
+      const ssize_t len = recvfrom(_fd, _buf, sizeof _buf - 1, 0, (struct sockaddr *) &sa, &salen);
+      if (len < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == ENOBUFS) {
+          cb("", "");
+          continue;
+        }
+        return;
+      }
+      if (sa.nl_pid != 0) {
+        continue;  // only the kernel gets to tell us
+      }
+      // "add@/devices/...\0ACTION=add\0DEVPATH=...\0SUBSYSTEM=...\0..."
+      _buf[len] = '\0';
+      const char *action = nullptr, *subsystem = nullptr;
+      for (const char *p = _buf; p < _buf + len; p += strlen(p) + 1) {
+        if (strncmp(p, "ACTION=", 7) == 0) {
+          action = p + 7;
+        } else if (strncmp(p, "SUBSYSTEM=", 10) == 0) {
+          subsystem = p + 10;
+        }
+      }
+      if (action && subsystem) {
+        cb(action, subsystem);
+      }
+    }
+  }
+};
+
+// Network throughput for a set of interfaces, read over netlink so the
+// cost doesn't depend on how many other interfaces the machine has.  With
+// no names given we follow the IPv4 default route.
+class Net : public Metric {
+  std::vector<std::string> _names;
+  Rtnetlink _rtnl, _monitor;
+  std::vector<std::unique_ptr<Link>> _links;
+  std::vector<int> _ifindexes;
+
+  // What a sample recorded for one link.
+  // Written to the trace as is, so without any padding left to chance.
+  struct Traced {
+    int32_t ifindex;
+    uint32_t pad;
+    uint64_t rx, tx;
+  };
+  static_assert(sizeof(Traced) == 24, "no implicit padding in a Traced");
+
+  void _resolve() {
+    if (Trace::replaying()) {
+      return;
+    }
+    std::vector<int> wanted;
+    if (_names.empty()) {
+      if (int oif = _rtnl.default_route()) {
+        wanted.push_back(oif);
+      }
+    } else {
+      for (const auto &name : _names) {
+        if (unsigned idx = if_nametoindex(name.c_str())) {
+          wanted.push_back(idx);
+        }
+      }
+    }
+    _use(wanted);
+  }
+
+  void _use(std::vector<int> &wanted) {
+    if (wanted == _ifindexes) {
+      return;
+    }
+    std::vector<std::unique_ptr<Link>> links;
+    for (int idx : wanted) {
+      auto it = std::find_if(_links.begin(), _links.end(),
+                             [idx](const std::unique_ptr<Link> &l) { return l->ifindex == idx; });
+      links.emplace_back(it != _links.end() ? std::move(*it) : std::unique_ptr<Link>(new Link(idx)));
+    }
+    _links.swap(links);
+    _ifindexes.swap(wanted);
+  }
+
+public:
+  static const char *name() { return "Net"; }
+  static std::chrono::milliseconds interval() { return std::chrono::seconds(5); }
+  size_t capacity() const { return 1<<12; }
+
+  Net(const std::vector<std::string> &ifnames = std::vector<std::string>())
+    : _names(ifnames),
+      _rtnl(),
+      _monitor(RTMGRP_LINK | RTMGRP_IPV4_ROUTE) {
+    _resolve();
+  }
+
+  // Link and route notifications show up here.
+  int fd() const { return _monitor.fd(); }
+
+  // Switches to ifnames, or to the default route if empty.  Links that
+  // stay keep their history.
+  void interfaces(const std::vector<std::string> &ifnames) {
+    _names = ifnames;
+    _resolve();
+  }
+
+  // Picks the interfaces again after a link or route change.  Returns
+  // true if the set changed.
+  bool handle_events() {
+    if (!_monitor.drain()) {
+      return false;
+    }
+    const std::vector<int> old = _ifindexes;
+    _resolve();
+    return old != _ifindexes;
+  }
+
+  void sample() {
+    if (Trace::replaying()) {
+      _replay();
+      return;
+    }
+    Traced traced[8];
+    size_t ntraced = 0;
+    _rtnl.link_stats(_ifindexes, [&](int ifindex, const struct rtnl_link_stats64 &st) {
+        for (auto &l : _links) {
+          if (l->ifindex == ifindex) {
+            l->sample(st.rx_bytes, st.tx_bytes);
+          }
+        }
+        if (ntraced < sizeof traced / sizeof traced[0]) {
+          traced[ntraced++] = Traced{ifindex, 0, st.rx_bytes, st.tx_bytes};
+        }
+      });
+    if (Trace::recording()) {
+      Trace::write("net", traced, ntraced * sizeof traced[0]);
+    }
+  }
+
+private:
+  // Follows whichever links the recording was sampling.
+  void _replay() {
+    const char *data;
+    size_t len;
+    if (!Trace::get("net", data, len)) {
+      return;
+    }
+    std::vector<Traced> traced(len / sizeof(Traced));
+    memcpy(traced.data(), data, traced.size() * sizeof(Traced));
+    std::vector<int> wanted;
+    for (const auto &t : traced) {
+      wanted.push_back(t.ifindex);
+    }
+    _use(wanted);
+    for (const auto &t : traced) {
+      for (auto &l : _links) {
+        if (l->ifindex == t.ifindex) {
+          l->sample(t.rx, t.tx);
+        }
+      }
+    }
+  }
+
+public:
+
+  const std::vector<std::unique_ptr<Link>> &links() const { return _links; }
+
+  bool steady() const {
+    return std::all_of(_links.begin(), _links.end(),
+                       [](const std::unique_ptr<Link> &l) { return l->steady(); });
+  }
+
+  Color color() const { return NORMAL; }
+  void render(Writer &w) const {
+    for (size_t k = 0; k < _links.size(); ++k) {
+      if (k) {
+        w << ' ';
+      }
+      w << *_links[k];
+    }
+  }
+};
+
+static_assert(sizeof(struct dwmstatus_node) == 56, "the node snapshot is a wire format");
+
+// A nonblocking UDP socket bound to "[HOST:]PORT" if listening, or else
+// connected to "HOST[:PORT]", with DWMSTATUS_NODE_PORT if there's no port.
+// IPv6 addresses go in brackets.
+static int udp_socket(const std::string &spec, bool listening) {
+  std::string host, port = std::to_string(DWMSTATUS_NODE_PORT);
+  const size_t colon = spec.rfind(':');
+  if (!spec.empty() && spec[0] == '[') {
+    const size_t close = spec.find(']');
+    host = spec.substr(1, close == std::string::npos ? std::string::npos : close - 1);
+    if (close != std::string::npos && close + 1 < spec.size() && spec[close + 1] == ':') {
+      port = spec.substr(close + 2);
+    }
+  } else if (listening && spec.find_first_not_of("0123456789") == std::string::npos) {
+    port = spec;
+  } else if (colon != std::string::npos && spec.find(':') == colon) {
+    host = spec.substr(0, colon);
+    port = spec.substr(colon + 1);
+  } else {
+    host = spec;
+  }
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = listening ? AI_PASSIVE : 0;
+  const int r = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res);
+  if (r != 0) {
+    errx(1, "%s: %s", spec.c_str(), gai_strerror(r));
+  }
+  int fd = -1;
+  for (const struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd >= 0 && (listening ? bind(fd, ai->ai_addr, ai->ai_addrlen)
+                              : connect(fd, ai->ai_addr, ai->ai_addrlen)) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  if (fd < 0) {
+    err(1, "%s", spec.c_str());
+  }
+  return fd;
+}
+
+// A summary of the machines running `dwmstatus -a' against us: how many
+// are up, how many are busier than cpu.colors' orange, the busiest one
+// and a sparkline of their mean cpu.  Snapshots are received in batches
+// into fixed buffers and only update a table sized at startup, so a
+// storm of them costs no allocation and no redraw; the summary is worked
+// out on its own interval.
+class Cluster : public Metric {
+public:
+  static const size_t MAX_NODES = 1024;
+
+private:
+  struct Node {
+    char host[sizeof(dwmstatus_node::host) + 1];  // "" for a free slot
+    uint64_t seen, interval;  // ns
+    int cpu, mem;
+    double load;
+  };
+
+  static const size_t BATCH = 64;
+
+  int _fd;
+  // Open addressing on the host name, at most half full.
+  std::vector<Node> _nodes;
+  size_t _count;
+  struct dwmstatus_node _packets[BATCH];
+  struct iovec _iovs[BATCH];
+  struct mmsghdr _msgs[BATCH];
+
+  size_t _up, _busy;
+  const Node *_worst;
+  Sparkline<30> _trend;
+
+  static uint32_t _hash(const char *s) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (; *s; ++s) {
+      h = (h ^ uint8_t(*s)) * 16777619u;
+    }
+    return h;
+  }
+
+  // The slot for host, claiming a free one if we have room.
+  Node *_find(const char *host) {
+    for (size_t i = _hash(host) % _nodes.size();; i = (i + 1) % _nodes.size()) {
+      Node &node = _nodes[i];
+      if (strcmp(node.host, host) == 0) {
+        return &node;
+      }
+      if (!node.host[0]) {
+        if (_count == MAX_NODES) {
+          return nullptr;
+        }
+        ++_count;
+        strcpy(node.host, host);
+        return &node;
+      }
+    }
+  }
+
+  void _receive(const struct dwmstatus_node &p, size_t len, uint64_t now) {
+    if (len != sizeof p || ntohl(p.magic) != DWMSTATUS_NODE_MAGIC ||
+        ntohs(p.version) != DWMSTATUS_NODE_VERSION) {
+      return;
+    }
+    char host[sizeof(Node::host)];
+    const size_t n = strnlen(p.host, sizeof p.host);
+    // Anyone on the network can send us a snapshot, and the host goes
+    // into the status line, where bytes 1-8 and a high bit mean colors
+    // and bars.  No hostname needs either.
+    for (size_t i = 0; i < n; ++i) {
+      if (p.host[i] < 0x20 || p.host[i] > 0x7e) {
+        return;
+      }
+    }
+    memcpy(host, p.host, n);
+    host[n] = '\0';
+    Node *node = host[0] ? _find(host) : nullptr;
+    if (!node) {
+      return;
+    }
+    node->seen = now;
+    node->interval = std::max<uint64_t>(1, ntohs(p.interval)) * 1000000000ull;
+    node->cpu = p.cpu;
+    node->mem = p.mem;
+    node->load = ntohl(p.load) / 100.0;
+  }
+
+  // Up until it's missed a couple of snapshots.
+  static bool _up_at(const Node &node, uint64_t now) {
+    return node.host[0] && now - node.seen < 3 * node.interval;
+  }
+
+public:
+  static const char *name() { return "Cluster"; }
+  static std::chrono::milliseconds interval() { return std::chrono::seconds(5); }
+
+  Cluster() : _fd(-1), _count(0), _up(0), _busy(0), _worst(nullptr) {}
+  ~Cluster() {
+    if (_fd >= 0) {
+      close(_fd);
+    }
+  }
+  Cluster(const Cluster &) = delete;
+  Cluster &operator=(const Cluster &) = delete;
+
+  // Starts taking snapshots on "[HOST:]PORT".
+  void listen(const char *spec) {
+    _fd = udp_socket(spec, true);
+    // Room for a burst from every node at once.
+    const int rcvbuf = int(MAX_NODES * 2 * sizeof(struct dwmstatus_node));
+    setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+    _nodes.assign(2 * MAX_NODES, Node());
+    for (size_t i = 0; i < BATCH; ++i) {
+      _iovs[i].iov_base = &_packets[i];
+      _iovs[i].iov_len = sizeof _packets[i];
+      memset(&_msgs[i], 0, sizeof _msgs[i]);
+      _msgs[i].msg_hdr.msg_iov = &_iovs[i];
+      _msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+  }
+
+  bool present() const { return _fd >= 0; }
+  int fd() const { return _fd; }
+
+  // Takes every snapshot that's queued.
+  void handle_events() {
+    const uint64_t now = monotonic_ns();
+    int n;
+    while ((n = recvmmsg(_fd, _msgs, BATCH, MSG_DONTWAIT, nullptr)) > 0) {
+      for (int i = 0; i < n; ++i) {
+        _receive(_packets[i], _msgs[i].msg_len, now);
+      }
+    }
+  }
+
+  void sample() {
+    const uint64_t now = monotonic_ns();
+    _up = _busy = 0;
+    _worst = nullptr;
+    int sum = 0;
+    for (const auto &node : _nodes) {
+      if (!_up_at(node, now)) {
+        continue;
+      }
+      ++_up;
+      _busy += node.cpu > config().cpu.orange;
+      sum += node.cpu;
+      if (!_worst || node.cpu > _worst->cpu) {
+        _worst = &node;
+      }
+    }
+    if (_up) {
+      const int mean = sum / int(_up);
+      _trend.push(mean, grade(mean, config().cpu));
+    }
+  }
+
+  Color color() const { return NORMAL; }
+  void render(Writer &w) const {
+    {
+      ColorScope cs(w, _up < _count ? ORANGE : NORMAL);
+      w << int(_up) << '/' << int(_count) << " up";
+    }
+    if (_busy) {
+      ColorScope cs(w, RED);
+      w << ' ' << int(_busy) << " busy";
+    }
+    if (_worst) {
+      ColorScope cs(w, grade(_worst->cpu, config().cpu));
+      w << ' ' << _worst->host << ' ' << _worst->cpu << "% ";
+      w.fixed(_worst->load, 2);
+    }
+    w << ' ' << _trend;
+  }
+};
+
+// The last rendered text of one metric, and whether it changed since the
+// status line was last assembled.  Renders into the spare of two fixed
+// buffers and only swaps them if the output differs.  Also keeps latency
+// histograms for the metric: rendering is timed here, and callers time
+// their sampling into `sampling'.
+class Segment {
+  std::unique_ptr<char[]> _bufs[2];
+  Writer _writers[2];
+  int _cur;
+  bool _dirty;
+
+public:
+  const char *const name;
+  Histogram sampling, rendering;
+
+  explicit Segment(const char *n, size_t cap = 1<<10)
+    : _bufs{std::unique_ptr<char[]>(new char[cap]), std::unique_ptr<char[]>(new char[cap])},
+      _writers{Writer(_bufs[0].get(), cap), Writer(_bufs[1].get(), cap)},
+      _cur(0),
+      _dirty(true),
+      name(n)
+  {}
+  Segment(const Segment &) = delete;
+  Segment &operator=(const Segment &) = delete;
+
+  // Renders each of args in turn.  Returns true if the text differs from
+  // what we had.
+  template<class... Args>
+  bool update(const Args &... args) {
+    Stopwatch sw(rendering);
+    Writer &w = _writers[!_cur];
+    w.clear();
+    int expand[] = {0, ((void) (w << args), 0)...};
+    (void) expand;
+    const Writer &old = _writers[_cur];
+    if (w.size() == old.size() && memcmp(w.data(), old.data(), w.size()) == 0) {
+      return false;
+    }
+    _cur = !_cur;
+    _dirty = true;
+    return true;
+  }
+
+  const Writer &text() const { return _writers[_cur]; }
+  bool dirty() const { return _dirty; }
+  void clean() { _dirty = false; }
+};
+
+// Position of T in Ts.
+template<class T, class... Ts>
+struct IndexOf;
+template<class T, class... Ts>
+struct IndexOf<T, T, Ts...> : std::integral_constant<size_t, 0> {};
+template<class T, class U, class... Ts>
+struct IndexOf<T, U, Ts...> : std::integral_constant<size_t, 1 + IndexOf<T, Ts...>::value> {};
+
+// The status line: one long-lived instance of each of Metrics, each
+// rendering into its own Segment.  The line is only reassembled when one
+// of them changed.  Everything is looked up by type at compile time; only
+// which segments are drawn, and in what order, is decided at run time.
+template<class... Metrics>
+class StatusLayout {
+  static const size_t N = sizeof...(Metrics);
+  std::tuple<Metrics...> _metrics;
+  std::unique_ptr<Segment> _segments[N];
+  Segment _line;
+  // Indices of the segments drawn, in order.
+  std::array<uint8_t, N> _order;
+  std::array<bool, N> _shown;
+  size_t _nshown;
+  bool _rearranged;
+
+public:
+  explicit StatusLayout(size_t cap = 1<<14)
+    : _segments{std::unique_ptr<Segment>(
+          new Segment(Metrics::name(), std::get<IndexOf<Metrics, Metrics...>::value>(_metrics).capacity()))...},
+      _line("status", cap) {
+    arrange(std::vector<std::string>());
+  }
+  StatusLayout(const StatusLayout &) = delete;
+  StatusLayout &operator=(const StatusLayout &) = delete;
+
+  template<class M>
+  M &get() { return std::get<IndexOf<M, Metrics...>::value>(_metrics); }
+
+  template<class M>
+  Segment &segment() { return *_segments[IndexOf<M, Metrics...>::value]; }
+
+  // Renders M, followed by extra.  Returns true if its text changed.
+  template<class M, class... Extra>
+  bool update(const Extra &... extra) {
+    return segment<M>().update(get<M>(), extra...);
+  }
+
+  // Blanks M's segment, for metrics that aren't there.
+  template<class M>
+  bool clear() {
+    return segment<M>().update();
+  }
+
+  // Whether M is drawn at all; metrics that aren't needn't be sampled.
+  template<class M>
+  bool shown() const { return _shown[IndexOf<M, Metrics...>::value]; }
+
+  // Draws just the metrics named, in that order.  A name can be any
+  // prefix of a metric's name, in any case.  With no names, every metric
+  // is drawn in type order.
+  //
+  // Returns false if a name matches none of ours, and then leaves the
+  // layout alone and stores that name in *unknown.
+  bool arrange(const std::vector<std::string> &names, std::string *unknown = nullptr) {
+    static const char *const all[] = {Metrics::name()...};
+    std::array<uint8_t, N> order;
+    std::array<bool, N> shown;
+    size_t n = 0;
+    shown.fill(names.empty());
+    if (names.empty()) {
+      for (; n < N; ++n) {
+        order[n] = uint8_t(n);
+      }
+    }
+    for (const auto &name : names) {
+      size_t i = 0;
+      // "cpu" will do for Cpuinfo.
+      while (i < N && (name.empty() || strncasecmp(name.c_str(), all[i], name.size()) != 0)) {
+        ++i;
+      }
+      if (i == N) {
+        if (unknown) {
+          *unknown = name;
+        }
+        return false;
+      }
+      if (!shown[i] && n < N) {
+        order[n++] = uint8_t(i);
+        shown[i] = true;
+      }
+    }
+    _order = order;
+    _shown = shown;
+    _nshown = n;
+    _rearranged = true;
+    return true;
+  }
+
+  // Rebuilds the line from dirty segments.  Returns true if the result is
+  // different from what we last returned.
+  bool assemble() {
+    if (!_rearranged &&
+        std::none_of(&_segments[0], &_segments[N],
+                     [](const std::unique_ptr<Segment> &s) { return s->dirty(); })) {
+      return false;
+    }
+    for (auto &s : _segments) {
+      s->clean();
+    }
+    _rearranged = false;
+    return _line.update(*this);
+  }
+
+  friend Writer &operator<<(Writer &w, const StatusLayout &sl) {
+    for (size_t k = 0; k < sl._nshown; ++k) {
+      const Segment &s = *sl._segments[sl._order[k]];
+      w.write(s.text().data(), s.text().size());
+    }
+    return w;
+  }
+
+  const char *c_str() const { return _line.text().c_str(); }
+
+  // The segments, then the assembled line itself.
+  template<class F>
+  void for_each(F f) const {
+    for (const auto &s : _segments) {
+      f(*s);
+    }
+    f(_line);
+  }
+};
+
+// Our own cost so far (CPU time, wakeups, context switches) and the
+// latency of every metric.
+template<class Layout>
+static void report(FILE *f, const Layout &status, uint64_t start_ns) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) {
+    memset(&ru, 0, sizeof ru);
+  }
+  const double up = (monotonic_ns() - start_ns) / 1e9;
+  const double user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+  const double sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  fprintf(f, "up %.0fs  cpu %.3fs user %.3fs sys (%.4f%%)  wakeups %llu (%.2f/min)\n",
+          up, user, sys, up > 0 ? 100.0 * (user + sys) / up : 0.0,
+          (unsigned long long) EventLoop::all_wakeups(),
+          up > 0 ? 60.0 * EventLoop::all_wakeups() / up : 0.0);
+  fprintf(f, "csw %ld voluntary %ld involuntary  maxrss %ldk\n",
+          ru.ru_nvcsw, ru.ru_nivcsw, ru.ru_maxrss);
+  fprintf(f, "%-10s %-7s %8s %10s %10s %10s %10s\n",
+          "metric", "phase", "count", "mean(us)", "p50(us)", "p99(us)", "max(us)");
+  status.for_each([f](const Segment &s) {
+      const Histogram *hs[] = {&s.sampling, &s.rendering};
+      const char *phases[] = {"sample", "render"};
+      for (int k = 0; k < 2; ++k) {
+        if (!hs[k]->count()) {
+          continue;
+        }
+        fprintf(f, "%-10s %-7s %8llu %10.1f %10.1f %10.1f %10.1f\n",
+                s.name, phases[k], (unsigned long long) hs[k]->count(),
+                hs[k]->mean() / 1e3, hs[k]->percentile(50) / 1e3,
+                hs[k]->percentile(99) / 1e3, hs[k]->max() / 1e3);
+      }
+    });
+}
 
-  MixerHandle _handle;
+// Where the status line goes.  show() is only called when the line
+// changed, with it in dwm's encoding: color bytes and Bars inline.
+class Sink {
+public:
+  virtual ~Sink() {}
+  virtual void show(const char *line) = 0;
+};
 
+// Benchmarks.
+class NullSink : public Sink {
 public:
-  AlsaManager() : _handle() {
-    static const char *card = "default";
-    if (snd_mixer_attach(_handle.get(), card) != 0) {
-      err(1, "snd_mixer_attach");
-    }
-    if (snd_mixer_selem_register(_handle.get(), NULL, NULL) != 0) {
-      err(1, "snd_mixer_selem_register");
+  void show(const char *) {}
+};
+
+// The root window's name, which dwm draws.  WM_NAME is a predefined atom
+// and XFlush doesn't wait for a reply, so an update never round-trips to
+// the server.
+class XSink : public Sink {
+  Display *_dpy;
+  Window _root;
+public:
+  XSink() : _dpy(XOpenDisplay(NULL)) {
+    if (!_dpy) {
+      err(1, "Cannot open display.");
     }
+    _root = DefaultRootWindow(_dpy);
   }
+  ~XSink() {
+    XCloseDisplay(_dpy);
+  }
+  XSink(const XSink &) = delete;
+  XSink &operator=(const XSink &) = delete;
 
-  class AlsaMetric : public Metric {
-    long _volume;
-    bool _muted;
-  public:
-    AlsaMetric(long volume, bool muted) : _volume(volume), _muted(muted) {}
+  void show(const char *line) {
+    XChangeProperty(_dpy, _root, XA_WM_NAME, XA_STRING, 8, PropModeReplace,
+                    reinterpret_cast<const unsigned char *>(line), strlen(line));
+    XFlush(_dpy);
+  }
+};
 
-    enum Color color() const { return NORMAL; }
-    operator std::string() const {
-      std::stringstream ss;
-      ss << "v ";
-      const long v = _muted ? 0 : _volume;
-      const int h = std::max(0, std::min(12, int(12 * v / 100.0)));
-      ss << Bar(0, 13 - h, 5, h, 5, true, CYAN);
-      return ss.str();
-    }
+// One line per update on stdout, for bars that read a status command:
+// lemonbar and friends get the plain text, i3bar/swaybar get its JSON
+// protocol with one block per colored run.
+class StreamSink : public Sink {
+public:
+  enum Format {
+    PLAIN,
+    I3BAR
   };
 
-  AlsaMetric get_volume() const {
-    MixerLoader loader(_handle.get());
-
-    static const char *mix_name = "Master";
-    static int mix_index = 0;
-    MixerSelemId sid(mix_name, mix_index);
+private:
+  const Format _format;
+  char _buf[1<<15];
+  Writer _w;
 
-    snd_mixer_elem_t *elem;
-    if (!(elem = snd_mixer_find_selem(_handle.get(), sid.get()))) {
-      err(1, "snd_mixer_find_selem");
+  static const char *hex(Color c) {
+    switch (c) {
+    case NORMAL:
+      return nullptr;
+    case SELECTED:
+      return "#ffffff";
+    case RED:
+      return "#ff0000";
+    case ORANGE:
+      return "#ff8000";
+    case YELLOW:
+      return "#ffff00";
+    case BLUE:
+      return "#0080ff";
+    case CYAN:
+      return "#00ffff";
+    case GREEN:
+      return "#00ff00";
     }
+    return nullptr;
+  }
 
-    long minv, maxv;
-    if (snd_mixer_selem_get_playback_volume_range(elem, &minv, &maxv) != 0) {
-      err(1, "snd_mixer_selem_get_playback_volume_range");
+  void json_char(char c) {
+    if (c == '"' || c == '\\') {
+      _w << '\\' << c;
+    } else if ((unsigned char) c < 0x20) {
+      static const char digits[] = "0123456789abcdef";
+      _w << "\\u00" << digits[(c >> 4) & 0xf] << digits[c & 0xf];
+    } else {
+      _w << c;
     }
-    long lvol, rvol;
-    if (snd_mixer_selem_get_playback_volume(elem, SND_MIXER_SCHN_FRONT_LEFT, &lvol) != 0) {
-      err(1, "snd_mixer_selem_get_playback_volume");
+  }
+
+  void open_block() {
+    _w << "{\"full_text\":\"";
+  }
+
+  void close_block(Color c) {
+    _w << '"';
+    if (const char *h = hex(c)) {
+      _w << ",\"color\":\"" << h << '"';
     }
-    if (snd_mixer_selem_get_playback_volume(elem, SND_MIXER_SCHN_FRONT_RIGHT, &rvol) != 0) {
-      err(1, "snd_mixer_selem_get_playback_volume");
+    _w << ",\"separator\":false}";
+  }
+
+  // Walks the dwm encoding, calling text(c) for each printable byte and
+  // run(color) whenever the color changes.  Bars, series and stacks are
+  // dropped.
+  template<class Text, class Run>
+  static void decode(const char *p, Text text, Run run) {
+    Color color = NORMAL;
+    while (*p) {
+      const unsigned char c = *p;
+      if (c & 0x80) {
+        dwmstatus_bars_decode(&p, nullptr, nullptr);
+        continue;
+      }
+      if (c <= GREEN) {
+        if (Color(c) != color) {
+          color = Color(c);
+          run(color);
+        }
+      } else {
+        text(c);
+      }
+      ++p;
     }
-    long vol = (lvol + rvol) / 2;
-    int lunmuted, runmuted;
-    if (snd_mixer_selem_get_playback_switch(elem, SND_MIXER_SCHN_FRONT_LEFT, &lunmuted) != 0) {
-      err(1, "snd_mixer_selem_get_playback_switch");
+  }
+
+  void flush() {
+    _w << '\n';
+    const char *p = _w.data();
+    size_t n = _w.size();
+    while (n > 0) {
+      const ssize_t r = ::write(STDOUT_FILENO, p, n);
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        err(1, "write(stdout)");
+      }
+      p += r;
+      n -= r;
     }
-    if (snd_mixer_selem_get_playback_switch(elem, SND_MIXER_SCHN_FRONT_RIGHT, &runmuted) != 0) {
-      err(1, "snd_mixer_selem_get_playback_switch");
+  }
+
+public:
+  explicit StreamSink(Format format) : _format(format), _w(_buf, sizeof _buf) {
+    if (_format == I3BAR) {
+      _w << "{\"version\":1}\n[";
+      flush();
     }
+  }
 
-    return AlsaMetric(100.0 * (vol - minv) / (maxv - minv), lunmuted == 0 && runmuted == 0);
+  void show(const char *line) {
+    _w.clear();
+    if (_format == PLAIN) {
+      // dwm tells neighbouring metrics apart by color, so each change of
+      // color becomes a space here.
+      bool gap = false;
+      decode(line,
+             [&](char c) {
+               if (gap && _w.size() && _w.data()[_w.size() - 1] != ' ' && c != ' ') {
+                 _w << ' ';
+               }
+               gap = false;
+               _w << c;
+             },
+             [&](Color) { gap = true; });
+    } else {
+      // Blocks for empty runs are left out.
+      Color color = NORMAL;
+      bool open = false, first = true;
+      _w << '[';
+      decode(line,
+             [&](char c) {
+               if (!open) {
+                 if (!first) {
+                   _w << ',';
+                 }
+                 first = false;
+                 open_block();
+                 open = true;
+               }
+               json_char(c);
+             },
+             [&](Color c) {
+               if (open) {
+                 close_block(color);
+                 open = false;
+               }
+               color = c;
+             });
+      if (open) {
+        close_block(color);
+      }
+      _w << "],";
+    }
+    flush();
   }
 };
 
-class Dir {
-  DIR *_dir;
+// Publishes what we sampled in the shared memory segment described in
+// dwmstatus.h, so other tools on the box can read it instead of sampling
+// /proc themselves.  We're the only writer; readers retry around the
+// seqlock in struct dwmstatus_shm.
+class SharedSnapshot {
+  std::string _name;
+  struct dwmstatus_shm *_shm;
 
-  const char *_next() const {
-    struct dirent *ent = readdir(_dir);
-    if (ent == NULL) {
-      return NULL;
-    }
-    return ent->d_name;
+  void begin() {
+    __atomic_store_n(&_shm->seq, _shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+  void end() {
+    __atomic_store_n(&_shm->seq, _shm->seq + 1, __ATOMIC_RELEASE);
   }
 
 public:
-  Dir(const char *name) : _dir(opendir(name)) {
-    if (_dir == NULL) {
-      err(1, "opendir");
+  SharedSnapshot() : _shm(nullptr) {
+    char name[64];
+    snprintf(name, sizeof name, DWMSTATUS_SHM_NAME_FMT, unsigned(getuid()));
+    _name = name;
+    // The name is easy to guess, so a segment that's already there is
+    // only taken over if it's one we left behind: someone else's could be
+    // fed forged values or truncated under us.
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == EEXIST) {
+      fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+      struct stat st;
+      if (fd >= 0 && fstat(fd, &st) != 0) {
+        err(1, "fstat(%s)", name);
+      }
+      if (fd >= 0 && (st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))) {
+        errx(1, "%s: not ours, or writable by others", name);
+      }
     }
-  }
-  ~Dir() {
-    if (_dir) {
-      closedir(_dir);
+    if (fd < 0) {
+      err(1, "shm_open(%s)", name);
     }
+    if (ftruncate(fd, sizeof *_shm) != 0) {
+      err(1, "ftruncate(%s)", name);
+    }
+    void *p = mmap(NULL, sizeof *_shm, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      err(1, "mmap(%s)", name);
+    }
+    _shm = static_cast<struct dwmstatus_shm *>(p);
+    // A segment left behind by an earlier run may be mid-update; start
+    // over from an even sequence number.
+    __atomic_store_n(&_shm->seq, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(reinterpret_cast<char *>(_shm) + offsetof(struct dwmstatus_shm, updated), 0,
+           sizeof *_shm - offsetof(struct dwmstatus_shm, updated));
+    _shm->magic = DWMSTATUS_SHM_MAGIC;
+    _shm->version = DWMSTATUS_SHM_VERSION;
+    _shm->size = sizeof *_shm;
+    end();
   }
+  ~SharedSnapshot() {
+    munmap(_shm, sizeof *_shm);
+    shm_unlink(_name.c_str());
+  }
+  SharedSnapshot(const SharedSnapshot &) = delete;
+  SharedSnapshot &operator=(const SharedSnapshot &) = delete;
 
-  const char *next() const {
-    const char *ret = _next();
-    if (ret == NULL) {
-      return NULL;
+  template<class Layout>
+  void publish(Layout &status) {
+    const Cpuinfo &cpu = status.template get<Cpuinfo>();
+    const Meminfo &mem = status.template get<Meminfo>();
+    const Net &net = status.template get<Net>();
+    const Battery &bat = status.template get<Battery>();
+    const AlsaManager::AlsaMetric &vol = status.template get<AlsaManager::AlsaMetric>();
+
+    begin();
+    _shm->updated = monotonic_ns();
+    const int ncpu = std::min(cpu.ncpu(), DWMSTATUS_SHM_MAX_CPUS);
+    _shm->ncpu = ncpu;
+    for (int i = 0; i <= ncpu; ++i) {
+      _shm->cpu[i].user = cpu.user(i);
+      _shm->cpu[i].sys = cpu.sys(i);
+      _shm->cpu[i].io = cpu.io(i);
     }
-    while (std::string(".") == ret || std::string("..") == ret) {
-      ret = _next();
+    _shm->mem_total = mem.total_kb();
+    _shm->mem_free = mem.free_kb();
+    _shm->mem_buffers = mem.buffers_kb();
+    _shm->mem_cached = mem.cached_kb();
+    uint32_t nlinks = 0;
+    for (const auto &l : net.links()) {
+      if (nlinks == DWMSTATUS_SHM_MAX_LINKS) {
+        break;
+      }
+      struct dwmstatus_shm_link &sl = _shm->link[nlinks++];
+      sl.ifindex = l->ifindex;
+      sl.rx = l->have_rates() ? l->rx_rate() : 0;
+      sl.tx = l->have_rates() ? l->tx_rate() : 0;
     }
-    return ret;
+    _shm->nlinks = nlinks;
+    _shm->temp = status.template get<Temp>().celsius();
+    _shm->battery_present = bat.present();
+    _shm->battery_percent = bat.percent();
+    _shm->battery_minutes = bat.minutes();
+    _shm->battery_direction = bat.direction();
+    _shm->volume = vol.volume();
+    _shm->muted = vol.muted();
+    end();
   }
 };
 
-class Wifi : public Metric {
-  enum State {
-    DISCONNECTED = 0,
-    SEARCHING,
-    CONNECTING,
-    CONNECTED,
-    WIFI_OFF
-  };
+#ifndef DWMSTATUS_NO_MAIN
+// Where SIGUSR1 writes the report, besides stderr.
+static std::string stats_path() {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (dir && *dir) {
+    return std::string(dir) + "/dwmstatus.stats";
+  }
+  return "/tmp/dwmstatus-" + std::to_string(getuid()) + ".stats";
+}
 
-  class WpaCtrl {
-    struct wpa_ctrl *_c;
-  public:
-    WpaCtrl(const char *sock) : _c(wpa_ctrl_open(sock)) {}
-    ~WpaCtrl() {
-      if (_c != NULL) {
-        wpa_ctrl_close(_c);
+// $XDG_CONFIG_HOME/dwmstatus/config, or ~/.config/dwmstatus/config.
+static std::string config_path() {
+  const char *dir = getenv("XDG_CONFIG_HOME");
+  if (dir && *dir) {
+    return std::string(dir) + "/dwmstatus/config";
+  }
+  const char *home = getenv("HOME");
+  return std::string(home ? home : "") + "/.config/dwmstatus/config";
+}
+
+// A Cpuinfo::Grouping by its -c / cpu.group name, or -1.
+static int grouping_by_name(const char *name) {
+  static const char *const groupings[] = {"cpu", "numa", "l3", "pct"};
+  for (int g = 0; g < 4; ++g) {
+    if (strcmp(name, groupings[g]) == 0) {
+      return g;
+    }
+  }
+  return -1;
+}
+
+// Reads "key = value" lines, with '#' starting a comment:
+//
+//   order = cpu top mem net temp wifi bat alsa date
+//   net = wlp3s0 enp0s25         # default: the default route's
+//   net.max_rx = 50              # megabits/s; also net.max_tx
+//   alsa.card = default
+//   alsa.mixer = Master
+//   cpu.group = pct              # like -c
+//   top = 3                      # like -t
+//   bars = compact               # needs a dwm with dwmstatus-bars.h
+//   cpu.colors = 90 75 50 10     # where it turns red, orange, yellow, green
+//
+// and likewise temp.colors, net.rx.colors and net.tx.colors (in kB/s),
+// disk.colors and psi.colors, and battery.colors with three percentages
+// it turns red, orange and yellow below.  -inf is a threshold that always
+// passes.  A missing file means the defaults.  On an error, returns false
+// with the reason in error and leaves c as it was.
+static bool load_config(const std::string &path, Config &c, std::string &error) {
+  Config parsed;
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    if (errno == ENOENT) {
+      c = parsed;
+      return true;
+    }
+    error = path + ": " + strerror(errno);
+    return false;
+  }
+  static const struct {
+    const char *key;
+    Grades Config::*grades;
+    size_t n;
+  } ramps[] = {
+    {"cpu.colors", &Config::cpu, 4},
+    {"temp.colors", &Config::temp, 4},
+    {"net.rx.colors", &Config::rx, 4},
+    {"net.tx.colors", &Config::tx, 4},
+    {"disk.colors", &Config::disk, 4},
+    {"psi.colors", &Config::psi, 4},
+    {"battery.colors", &Config::battery, 3},
+  };
+  char *line = nullptr;
+  size_t cap = 0;
+  int lineno = 0;
+  std::string problem;
+  while (problem.empty() && getline(&line, &cap, f) > 0) {
+    ++lineno;
+    line[strcspn(line, "#\n")] = '\0';
+    std::vector<std::string> words;
+    for (char *p = line; *p;) {
+      p += strspn(p, " \t");
+      const size_t len = strcspn(p, " \t");
+      if (len) {
+        words.emplace_back(p, len);
       }
+      p += len;
+    }
+    if (words.empty()) {
+      continue;
     }
+    const std::string key = words[0];
+    if (words.size() < 2 || words[1] != "=") {
+      problem = "expected \"" + key + " = ...\"";
+      continue;
+    }
+    words.erase(words.begin(), words.begin() + 2);
 
-    bool ok() const {
-      return _c != NULL;
+    // All the numeric keys take doubles.
+    std::vector<double> nums;
+    bool numeric = true;
+    for (const auto &w : words) {
+      char *end;
+      nums.push_back(strtod(w.c_str(), &end));
+      numeric = numeric && *end == '\0';
     }
 
-    void status(std::string &ssid, enum State &state) {
-      char buf[1<<12];
-      size_t bufsz = sizeof buf;
-      int ret = wpa_ctrl_request(_c, "STATUS", (sizeof "STATUS") - 1, buf, &bufsz, NULL);
-      if (ret != 0) {
-        err(1, "wpa_ctrl_request");
-      }
-
-      std::string statusstr(buf, bufsz);
-      std::istringstream iss(statusstr);
-      while (iss.good()) {
-        std::string key;
-        std::getline(iss, key, '=');
-        if (key == "ssid") {
-          std::getline(iss, ssid);
-        } else if (key == "wpa_state") {
-          std::string statestr;
-          std::getline(iss, statestr);
-          if (statestr == "COMPLETED") {
-            state = CONNECTED;
-          } else if (statestr == "DISCONNECTED" || statestr == "INACTIVE") {
-            state = DISCONNECTED;
-          } else if (statestr == "SCANNING") {
-            state = SEARCHING;
-          } else if (statestr == "INTERFACE_DISABLED") {
-            state = WIFI_OFF;
-          } else {
-            state = CONNECTING;
-          }
+    if (key == "order") {
+      parsed.order = words;
+    } else if (key == "net") {
+      parsed.interfaces = words;
+    } else if (key == "net.max_rx" || key == "net.max_tx") {
+      if (nums.size() != 1 || !numeric || nums[0] <= 0) {
+        problem = key + " takes one positive number";
+      } else {
+        (key == "net.max_rx" ? parsed.max_rx_mbit : parsed.max_tx_mbit) = nums[0];
+      }
+    } else if (key == "alsa.card" || key == "alsa.mixer") {
+      if (words.size() != 1) {
+        problem = key + " takes one name";
+      } else {
+        (key == "alsa.card" ? parsed.alsa_card : parsed.alsa_mixer) = words[0];
+      }
+    } else if (key == "bars") {
+      if (words.size() != 1 || (words[0] != "plain" && words[0] != "compact")) {
+        problem = "bars is plain or compact";
+      } else {
+        parsed.compact_bars = words[0] == "compact";
+      }
+    } else if (key == "cpu.group") {
+      if (words.size() != 1 || (parsed.grouping = grouping_by_name(words[0].c_str())) < 0) {
+        problem = "cpu.group is one of cpu, numa, l3 or pct";
+      }
+    } else if (key == "top") {
+      if (nums.size() != 1 || !numeric || nums[0] < 0 || nums[0] != int(nums[0])) {
+        problem = "top takes a count";
+      } else {
+        parsed.top = int(nums[0]);
+      }
+    } else {
+      auto ramp = std::find_if(std::begin(ramps), std::end(ramps),
+                               [&key](const decltype(ramps[0]) &r) { return key == r.key; });
+      if (ramp == std::end(ramps)) {
+        problem = "unknown key " + key;
+      } else if (nums.size() != ramp->n || !numeric) {
+        problem = key + " takes " + std::to_string(ramp->n) + " numbers";
+      } else {
+        Grades &g = parsed.*ramp->grades;
+        double *thresholds[] = {&g.red, &g.orange, &g.yellow, &g.green};
+        for (size_t k = 0; k < ramp->n; ++k) {
+          *thresholds[k] = nums[k];
         }
-        std::string discard;
-        std::getline(iss, discard);
       }
     }
-  };
+  }
+  free(line);
+  fclose(f);
+  if (!problem.empty()) {
+    error = path + ":" + std::to_string(lineno) + ": " + problem;
+    return false;
+  }
+  c = parsed;
+  return true;
+}
 
-  std::string _ssid;
-  enum State _state;
-  bool _present;
+// Says when the config file may have changed.  Watches its directory
+// rather than the file itself, since editors save by writing a new file
+// and renaming it over the old one.  Without the directory there's
+// nothing to reload, and fd() never fires.
+class ConfigWatch {
+  int _fd;
+  std::string _name;
 
 public:
-  Wifi() : _ssid(""), _state(WIFI_OFF), _present(false) {
-    if (dir_exists("/run/wpa_supplicant")) {
-      Dir dir("/run/wpa_supplicant");
-      while (const char *name = dir.next()) {
-        std::stringstream ss;
-        ss << "/run/wpa_supplicant/" << name;
-        WpaCtrl c(ss.str().c_str());
-        if (c.ok()) {
-          _present = true;
-          c.status(_ssid, _state);
-          if (_state == CONNECTED) {
-            break;
-          }
+  explicit ConfigWatch(const std::string &path)
+    : _fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+    if (_fd < 0) {
+      err(1, "inotify_init1");
+    }
+    const size_t slash = path.rfind('/');
+    const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    _name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+    if (inotify_add_watch(_fd, dir.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0 &&
+        errno != ENOENT) {
+      warn("inotify_add_watch(%s)", dir.c_str());
+    }
+  }
+  ~ConfigWatch() {
+    close(_fd);
+  }
+  ConfigWatch(const ConfigWatch &) = delete;
+  ConfigWatch &operator=(const ConfigWatch &) = delete;
+
+  int fd() const { return _fd; }
+
+  // Drains the pending events.  Returns true if any was about our file.
+  bool changed() {
+    alignas(struct inotify_event) char buf[4096];
+    bool ret = false;
+    ssize_t n;
+    while ((n = read(_fd, buf, sizeof buf)) > 0) {
+      for (const char *p = buf; p < buf + n;) {
+        const struct inotify_event *ev = reinterpret_cast<const struct inotify_event *>(p);
+        if (ev->len && _name == ev->name) {
+          ret = true;
         }
+        p += sizeof *ev + ev->len;
       }
     }
+    return ret;
   }
+};
 
-  enum Color color() const {
-    switch (_state) {
-    case WIFI_OFF:
-      return RED;
-    case DISCONNECTED:
-      return ORANGE;
-    case SEARCHING:
-      return YELLOW;
-    case CONNECTING:
-      return GREEN;
-    case CONNECTED:
-      return BLUE;
-    }
-    return NORMAL;
+// -a: no status line, just what Load, Cpuinfo and Meminfo read, sent to
+// target every Cpuinfo::interval() for a `dwmstatus -l' to summarize.  A
+// snapshot the socket can't take right away is dropped.
+static int run_agent(const char *target) {
+  const int fd = udp_socket(target, false);
+  struct dwmstatus_node p;
+  memset(&p, 0, sizeof p);
+  p.magic = htonl(DWMSTATUS_NODE_MAGIC);
+  p.version = htons(DWMSTATUS_NODE_VERSION);
+  p.interval = htons(uint16_t(std::chrono::duration_cast<std::chrono::seconds>(
+                                Cpuinfo::interval()).count()));
+  p.ncpu = htons(uint16_t(getncpu()));
+  char host[HOST_NAME_MAX + 1] = "";
+  gethostname(host, sizeof host);
+  host[strcspn(host, ".")] = '\0';
+  memcpy(p.host, host, std::min(strlen(host), sizeof p.host));
+
+  Cpuinfo cpuinfo;
+  Meminfo mem;
+  uint32_t seq = 0;
+  EventLoop loop;
+  loop.every(Cpuinfo::interval(), [&]() {
+      cpuinfo.sample();
+      mem.sample();
+      p.seq = htonl(++seq);
+      p.load = htonl(uint32_t(Load().one_minute() * 100));
+      p.cpu = uint8_t(cpuinfo.pct(0));
+      p.user = uint8_t(cpuinfo.user(0));
+      p.sys = uint8_t(cpuinfo.sys(0));
+      p.io = uint8_t(cpuinfo.io(0));
+      p.mem = uint8_t(mem.pct());
+      // A refusal of an earlier snapshot, from before anyone listened,
+      // comes back from this send() instead of sending it.
+      if (send(fd, &p, sizeof p, MSG_DONTWAIT) < 0 && errno == ECONNREFUSED) {
+        send(fd, &p, sizeof p, MSG_DONTWAIT);
+      }
+      return false;
+    });
+  for (;;) {
+    loop.wait();
   }
+}
 
-  operator std::string() const {
-    if (_state == WIFI_OFF) {
-      return "wifi off";
-    } else if (_ssid.empty()) {
-      return "???";
-    } else {
-      return _ssid;
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-s] [-f CONFIG] [-c cpu|numa|l3|pct] [-t N] [-l [HOST:]PORT]\n"
+          "       [-o x|plain|i3bar|null] [--record FILE | --replay FILE]\n"
+          "       %s -a HOST[:PORT]\n", argv0, argv0);
+  exit(2);
+}
+
+// Sampling is never urgent.  Let the kernel push our wakeups up to 50ms
+// late to batch them with someone else's, and only run us when nothing
+// else wants the cpu.  Threads started afterwards inherit both.
+static void stay_out_of_the_way() {
+  static const unsigned long TIMER_SLACK_NS = 50 * 1000 * 1000;
+  if (prctl(PR_SET_TIMERSLACK, TIMER_SLACK_NS, 0, 0, 0) != 0) {
+    warn("prctl(PR_SET_TIMERSLACK)");
+  }
+  struct sched_param sp;
+  sp.sched_priority = 0;
+  if (sched_setscheduler(0, SCHED_IDLE, &sp) != 0) {
+    warn("sched_setscheduler(SCHED_IDLE)");
+  }
+}
+
+static std::unique_ptr<Sink> make_sink(const char *name) {
+  if (strcmp(name, "x") == 0) {
+    return std::unique_ptr<Sink>(new XSink);
+  } else if (strcmp(name, "plain") == 0) {
+    return std::unique_ptr<Sink>(new StreamSink(StreamSink::PLAIN));
+  } else if (strcmp(name, "i3bar") == 0) {
+    return std::unique_ptr<Sink>(new StreamSink(StreamSink::I3BAR));
+  } else if (strcmp(name, "null") == 0) {
+    return std::unique_ptr<Sink>(new NullSink);
+  }
+  return nullptr;
+}
+
+int main(int argc, char **argv) {
+  const char *output = nullptr, *record = nullptr, *replay = nullptr, *config_file = nullptr;
+  const char *agent = nullptr, *listen = nullptr;
+  bool shared = false;
+  int grouping = -1, top = -1;
+  static const struct option longopts[] = {
+    {"record", required_argument, NULL, 'r'},
+    {"replay", required_argument, NULL, 'R'},
+    {NULL, 0, NULL, 0}
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "sf:c:t:o:r:R:a:l:", longopts, NULL)) != -1) {
+    switch (c) {
+    case 's':
+      shared = true;
+      break;
+    case 'f':
+      config_file = optarg;
+      break;
+    case 'c':
+      if ((grouping = grouping_by_name(optarg)) < 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 't': {
+      char *end;
+      top = int(strtol(optarg, &end, 10));
+      if (*end || top < 0) {
+        usage(argv[0]);
+      }
+      break;
     }
+    case 'o': {
+      static const char *const sinks[] = {"x", "plain", "i3bar", "null"};
+      output = nullptr;
+      for (const char *name : sinks) {
+        if (strcmp(optarg, name) == 0) {
+          output = name;
+        }
+      }
+      if (!output) {
+        usage(argv[0]);
+      }
+      break;
+    }
+    case 'a':
+      agent = optarg;
+      break;
+    case 'l':
+      listen = optarg;
+      break;
+    case 'r':
+      record = optarg;
+      break;
+    case 'R':
+      replay = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc || (record && replay) || (agent && (listen || replay))) {
+    usage(argv[0]);
   }
 
-  bool present() const { return _present; }
-};
+  // The trace has to be in place before the collectors first read.
+  if (record) {
+    Trace::record(record);
+  } else if (replay) {
+    Trace::replay(replay);
+  }
+  const std::string path = config_file ? config_file : config_path();
+  std::string error;
+  if (!load_config(path, config(), error)) {
+    warnx("%s", error.c_str());
+  }
+  // A replay is a benchmark, so it runs flat out.
+  if (!replay) {
+    stay_out_of_the_way();
+  }
+  if (agent) {
+    return run_agent(agent);
+  }
+  // SIGUSR1 is read from a signalfd below.  Block it before starting any
+  // threads, so they inherit the mask and it can't kill us through one.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0) {
+    err(1, "sigprocmask");
+  }
+  // Connecting to X can take a while at login.  Let it happen alongside
+  // the collectors' discovery and only wait for it before the first draw.
+  std::future<std::unique_ptr<Sink>> pending_sink =
+    std::async(std::launch::async, make_sink, output ? output : replay ? "null" : "x");
 
-class Net : public Metric {
-  const size_t N;
-  const std::string iftok;
-  mutable size_t rx[60], tx[60];
-  mutable std::chrono::time_point<std::chrono::system_clock> t[60];
-  mutable size_t i;
+  const uint64_t start_ns = monotonic_ns();
+  typedef Wifi::WifiMetric WifiMetric;
+  typedef AlsaManager::AlsaMetric AlsaMetric;
+  StatusLayout<Cpuinfo, Top, Meminfo, Pressure, Disk, Net, Temp, WifiMetric, Battery, AlsaMetric,
+               Cluster, Datetime> status;
+  Cpuinfo &cpuinfo = status.get<Cpuinfo>();
+  Top &procs = status.get<Top>();
+  Meminfo &mem = status.get<Meminfo>();
+  Pressure &psi = status.get<Pressure>();
+  Disk &disk = status.get<Disk>();
+  Net &n = status.get<Net>();
+  Temp &t = status.get<Temp>();
+  Battery &bat = status.get<Battery>();
+  Cluster &cluster = status.get<Cluster>();
+  if (listen && !replay) {
+    cluster.listen(listen);
+  }
+  Sparkline<30> cpu_trend, mem_trend;
+  EventLoop loop;
+
+  // Everything polled backs off while it reads steady, and further while
+  // we're on battery.
+  Backoff cpu_backoff(Cpuinfo::interval()), top_backoff(Top::interval()),
+    mem_backoff(Meminfo::interval()), psi_backoff(Pressure::interval()),
+    disk_backoff(Disk::interval()),
+    net_backoff(Net::interval()), temp_backoff(Temp::interval()),
+    battery_backoff(Battery::interval());
+
+  // Rendering from the last sample, apart from sampling, so a config
+  // reload can redraw with new thresholds.
+  auto show_cpu = [&]() { return status.update<Cpuinfo>(' ', cpu_trend); };
+  auto show_top = [&]() { return procs.limit() ? status.update<Top>() : status.clear<Top>(); };
+  auto show_mem = [&]() { return status.update<Meminfo>(' ', mem_trend); };
+  auto show_psi = [&]() {
+    return psi.present() ? status.update<Pressure>() : status.clear<Pressure>();
+  };
+  auto show_disk = [&]() { return disk.present() ? status.update<Disk>() : status.clear<Disk>(); };
+  auto show_net = [&]() { return status.update<Net>(); };
+  auto show_temp = [&]() { return status.update<Temp>(); };
+  auto show_battery = [&]() {
+    return bat.present() ? status.update<Battery>() : status.clear<Battery>();
+  };
+  auto show_cluster = [&]() {
+    return cluster.present() ? status.update<Cluster>() : status.clear<Cluster>();
+  };
+
+  // Metrics the config leaves out aren't sampled either, except Battery,
+  // which decides whether everything else backs off further.
+  auto sample_cpu = [&]() {
+    if (!status.shown<Cpuinfo>()) {
+      return false;
+    }
+    {
+      Stopwatch sw(status.segment<Cpuinfo>().sampling);
+      cpuinfo.sample();
+    }
+    Trace::mark(Cpuinfo::name());
+    cpuinfo.steady() ? cpu_backoff.steady() : cpu_backoff.moved();
+    cpu_trend.push(cpuinfo.pct(0), cpuinfo.color_for(0));
+    return show_cpu();
+  };
+  auto sample_top = [&]() {
+    if (!procs.limit() || !status.shown<Top>()) {
+      return false;
+    }
+    {
+      Stopwatch sw(status.segment<Top>().sampling);
+      procs.sample();
+    }
+    Trace::mark(Top::name());
+    procs.steady() ? top_backoff.steady() : top_backoff.moved();
+    return show_top();
+  };
+  auto sample_mem = [&]() {
+    if (!status.shown<Meminfo>()) {
+      return false;
+    }
+    {
+      Stopwatch sw(status.segment<Meminfo>().sampling);
+      mem.sample();
+    }
+    Trace::mark(Meminfo::name());
+    mem.steady() ? mem_backoff.steady() : mem_backoff.moved();
+    mem_trend.push(mem.pct(), mem.color());
+    return show_mem();
+  };
+  auto sample_psi = [&]() {
+    if (!status.shown<Pressure>()) {
+      return false;
+    }
+    {
+      Stopwatch sw(status.segment<Pressure>().sampling);
+      psi.sample();
+    }
+    Trace::mark(Pressure::name());
+    psi.steady() ? psi_backoff.steady() : psi_backoff.moved();
+    return show_psi();
+  };
+  auto sample_disk = [&]() {
+    if (!status.shown<Disk>()) {
+      return false;
+    }
+    {
+      Stopwatch sw(status.segment<Disk>().sampling);
+      disk.sample();
+    }
+    Trace::mark(Disk::name());
+    disk.steady() ? disk_backoff.steady() : disk_backoff.moved();
+    return show_disk();
+  };
+  auto sample_net = [&]() {
+    if (!status.shown<Net>()) {
+      return false;
+    }
+    {
+      Stopwatch sw(status.segment<Net>().sampling);
+      n.sample();
+    }
+    Trace::mark(Net::name());
+    n.steady() ? net_backoff.steady() : net_backoff.moved();
+    return show_net();
+  };
+  auto sample_temp = [&]() {
+    if (!status.shown<Temp>()) {
+      return false;
+    }
+    {
+      Stopwatch sw(status.segment<Temp>().sampling);
+      t.sample();
+    }
+    Trace::mark(Temp::name());
+    t.steady() ? temp_backoff.steady() : temp_backoff.moved();
+    return show_temp();
+  };
+  auto sample_battery = [&]() {
+    {
+      Stopwatch sw(status.segment<Battery>().sampling);
+      bat.sample();
+    }
+    Trace::mark(Battery::name());
+    bat.steady() ? battery_backoff.steady() : battery_backoff.moved();
+    Backoff::on_battery() = bat.discharging();
+    return show_battery();
+  };
+  auto sample_cluster = [&]() {
+    if (!cluster.present() || !status.shown<Cluster>()) {
+      return false;
+    }
+    {
+      Stopwatch sw(status.segment<Cluster>().sampling);
+      cluster.sample();
+    }
+    return show_cluster();
+  };
+  auto show_snapshots = [&](const Wifi::Snapshot &ws, const AlsaManager::Snapshot &vs) {
+    Trace::write("wifi", &ws, sizeof ws);
+    Trace::write("alsa", &vs, sizeof vs);
+    Trace::mark(WifiMetric::name());
+    status.get<WifiMetric>() = WifiMetric(ws);
+    status.get<AlsaMetric>() = AlsaMetric(vs.volume, vs.muted);
+    const bool w = ws.present ? status.update<WifiMetric>() : status.clear<WifiMetric>();
+    const bool v = vs.present ? status.update<AlsaMetric>() : status.clear<AlsaMetric>();
+    return w || v;
+  };
+
+  // The mixer for the worker thread to open.
+  struct AlsaSettings {
+    char card[64], mixer[64];
+  };
+  Seqlock<AlsaSettings> alsa_settings;
 
-  void next() const {
-    t[i % N] = std::chrono::system_clock::now();
-    std::ifstream f("/proc/net/dev");
-    std::string s;
-    while (f.good() && s != iftok) {
-      f >> s;
+  // Hands config() to the collectors that keep their own copy of part of
+  // it.  -c and -t win over the file.
+  auto apply_config = [&]() {
+    const Config &c = config();
+    std::string unknown;
+    if (!status.arrange(c.order, &unknown)) {
+      warnx("%s: no metric called %s", path.c_str(), unknown.c_str());
     }
-    f >> rx[i % N];
-    for (int j = 0; j < 7; ++j) {
-      int ignore;
-      f >> ignore;
+    const int g = grouping >= 0 ? grouping : c.grouping;
+    cpuinfo.group(g >= 0 ? Cpuinfo::Grouping(g) : cpuinfo.default_grouping());
+    procs.limit(top >= 0 ? top : c.top >= 0 ? c.top : Top::DEFAULT_LIMIT);
+    n.interfaces(c.interfaces);
+    AlsaSettings a;
+    snprintf(a.card, sizeof a.card, "%s", c.alsa_card.c_str());
+    snprintf(a.mixer, sizeof a.mixer, "%s", c.alsa_mixer.c_str());
+    alsa_settings.store(a);
+  };
+  // Everything on the main thread, rendered again from its last sample.
+  auto redraw = [&]() {
+    const bool changed[] = {
+      show_cpu(), show_top(), show_mem(), show_psi(), show_disk(), show_net(),
+      show_temp(), show_battery(), show_cluster(), status.update<Datetime>()
+    };
+    return std::any_of(std::begin(changed), std::end(changed), [](bool b) { return b; });
+  };
+  apply_config();
+  tzset();
+  status.update<Datetime>();
+
+  if (replay) {
+    // Run the same callbacks as the live loop, once per marker.
+    std::map<std::string, std::function<bool()>> samplers = {
+      {Cpuinfo::name(), sample_cpu},
+      {Top::name(), sample_top},
+      {Meminfo::name(), sample_mem},
+      {Pressure::name(), sample_psi},
+      {Disk::name(), sample_disk},
+      {Net::name(), sample_net},
+      {Temp::name(), sample_temp},
+      {Battery::name(), sample_battery},
+      {WifiMetric::name(), [&]() {
+          Wifi::Snapshot ws{false, Wifi::WIFI_OFF, ""};
+          AlsaManager::Snapshot vs{0, false, false};
+          const char *data;
+          size_t len;
+          if (Trace::get("wifi", data, len) && len == sizeof ws) {
+            memcpy(&ws, data, sizeof ws);
+          }
+          if (Trace::get("alsa", data, len) && len == sizeof vs) {
+            memcpy(&vs, data, sizeof vs);
+          }
+          return show_snapshots(ws, vs);
+        }},
+    };
+    std::unique_ptr<Sink> sink = pending_sink.get();
+    while (const char *marked = Trace::current()->next()) {
+      auto it = samplers.find(marked);
+      if (it != samplers.end() && it->second() && status.assemble()) {
+        sink->show(status.c_str());
+      }
     }
-    f >> tx[i % N];
-    i++;
+    // On stderr, so that what -o plain prints is only the recorded lines.
+    report(stderr, status, start_ns);
+    return 0;
   }
 
-public:
-  Net(const std::string &ifname) : N(60), iftok(ifname + ":"), i(0) {
-    std::fill(&rx[0], &rx[N], 0);
-    std::fill(&tx[0], &tx[N], 0);
+  loop.every(cpu_backoff, sample_cpu);
+  loop.every(top_backoff, sample_top);
+  loop.every(mem_backoff, sample_mem);
+  loop.every(psi_backoff, sample_psi);
+  loop.every(disk_backoff, sample_disk);
+  loop.every(net_backoff, sample_net);
+  loop.watch(n.fd(), [&]() {
+      return n.handle_events() && status.update<Net>();
+    });
+  loop.every(temp_backoff, sample_temp);
+  loop.every(battery_backoff, sample_battery);
+  if (cluster.present()) {
+    loop.watch(cluster.fd(), [&]() {
+        cluster.handle_events();
+        return false;
+      });
+    loop.every(Cluster::interval(), sample_cluster);
   }
-  Color color() const { return NORMAL; }
-  operator std::string() const {
-    next();
-    if (i < 3) {
-      return "";
-    }
 
-    std::stringstream ss;
-    {
-      size_t cur = (i - 1) % N;
-      size_t prev = (i - 2) % N;
-      auto secs = std::chrono::duration_cast<std::chrono::seconds>(t[cur] - t[prev]);
-      const double rx_rate = ((rx[cur] - rx[prev]) / 1024.0) / secs.count();
-      const double tx_rate = ((tx[cur] - tx[prev]) / 1024.0) / secs.count();
-      {
-        Metric::ColorScope<std::stringstream> cs(ss, (rx_rate > 4500
-                                                      ? RED
-                                                      : (rx_rate > 2000
-                                                         ? ORANGE
-                                                         : (rx_rate > 1000
-                                                            ? YELLOW
-                                                            : (rx_rate > 100
-                                                               ? GREEN
-                                                               : BLUE)))));
-        ss << std::setw(1) << std::setfill('0') << std::setprecision(1) << std::fixed;
-        if (rx_rate > (1<<10)) {
-          ss << (rx_rate / (1<<10)) << "M";
-        } else {
-          ss << rx_rate << "k";
+  // Devices that come and go.  Net follows its links over rtnetlink
+  // above; a power_supply change is also worth a fresh reading, as when
+  // the charger is plugged in.
+  Uevents uevents;
+  if (uevents.fd() >= 0) {
+    loop.watch(uevents.fd(), [&]() {
+        bool supplies = false, replugged = false, sensors = false, disks = false;
+        uevents.handle_events([&](const char *action, const char *subsystem) {
+            const bool all = !*subsystem;
+            const bool moved = all || strcmp(action, "add") == 0 || strcmp(action, "remove") == 0;
+            supplies = supplies || all || strcmp(subsystem, "power_supply") == 0;
+            replugged = replugged || (moved && (all || strcmp(subsystem, "power_supply") == 0));
+            sensors = sensors ||
+              (moved && (all || strcmp(subsystem, "thermal") == 0 || strcmp(subsystem, "hwmon") == 0));
+            // Card readers say "change" when a card goes in.
+            disks = disks || all || strcmp(subsystem, "block") == 0;
+          });
+        bool changed = false;
+        if (replugged) {
+          bat.discover();
+        }
+        if (supplies) {
+          changed = sample_battery() || changed;
         }
+        if (sensors) {
+          t.discover();
+          changed = show_temp() || changed;
+        }
+        if (disks) {
+          disk.discover();
+          changed = show_disk() || changed;
+        }
+        return changed;
+      });
+  }
+
+  // wpa_supplicant and ALSA live on the worker thread and hand us
+  // snapshots as they come up, so the cheap metrics above draw on the
+  // first wakeup without waiting for either.
+  Seqlock<Wifi::Snapshot> wifi_snapshot(Wifi::Snapshot{false, Wifi::WIFI_OFF, ""});
+  Seqlock<AlsaManager::Snapshot> volume_snapshot;
+  Histogram &wifi_sampling = status.segment<WifiMetric>().sampling;
+  Histogram &volume_sampling = status.segment<AlsaMetric>().sampling;
+  Worker worker([&](EventLoop &wloop) {
+      // These live as long as the worker thread, which is forever.
+      static std::unique_ptr<Wifi> w;
+      static std::unique_ptr<AlsaManager> alsa_manager;
+
+      static Backoff wifi_backoff(std::chrono::seconds(1), Wifi::interval());
+      // Doubled before each retry, so the first comes a second in.
+      static Backoff alsa_backoff(std::chrono::milliseconds(500));
+      static std::function<void()> reconnect_alsa;
+
+      auto publish_wifi = [&]() {
+        wifi_snapshot.store(w->snapshot());
+        worker.notify();
+        return true;
+      };
+      w.reset(new Wifi(wloop, publish_wifi));
+      publish_wifi();
+      // Without inotify, wpa_supplicant may still be starting; look again
+      // soon after any change and back off while nothing does.
+      if (!w->watching()) {
+        wloop.every(wifi_backoff, [&wifi_sampling, publish_wifi]() {
+            Stopwatch sw(wifi_sampling);
+            const bool changed = w->discover();
+            changed ? wifi_backoff.moved() : wifi_backoff.steady();
+            return changed && publish_wifi();
+          });
       }
-      {
-        Metric::ColorScope<std::stringstream> cs(ss, (tx_rate > 1000
-                                                      ? RED
-                                                      : (tx_rate > 500
-                                                         ? ORANGE
-                                                         : (tx_rate > 100
-                                                            ? YELLOW
-                                                            : (tx_rate > 50
-                                                               ? GREEN
-                                                               : BLUE)))));
-        ss << std::setw(1) << std::setfill('0') << std::setprecision(1) << std::fixed;
-        if (tx_rate > (1<<10)) {
-          ss << (tx_rate / (1<<10)) << "M";
-        } else {
-          ss << tx_rate << "k";
+
+      auto publish_volume = [&]() {
+        volume_snapshot.store(alsa_manager ? alsa_manager->snapshot()
+                                           : AlsaManager::Snapshot{0, false, false});
+        worker.notify();
+        return true;
+      };
+      // Drops the mixer, so the bar shows no volume until the next one.
+      auto drop_alsa = [&, publish_volume]() {
+        if (alsa_manager) {
+          for (int fd : alsa_manager->fds()) {
+            wloop.unwatch(fd);
+          }
+          alsa_manager.reset();
+          publish_volume();
         }
+      };
+      static AlsaSettings mixer = alsa_settings.load();
+      reconnect_alsa = wloop.retry(alsa_backoff, [&, publish_volume, drop_alsa]() {
+          alsa_manager.reset(new AlsaManager(mixer.card, mixer.mixer));
+          if (!alsa_manager->ok()) {
+            alsa_manager.reset();
+            return false;
+          }
+          publish_volume();
+          for (int fd : alsa_manager->fds()) {
+            wloop.watch(fd, [&, publish_volume, drop_alsa]() {
+                Stopwatch sw(volume_sampling);
+                if (alsa_manager->handle_events()) {
+                  return publish_volume();
+                }
+                if (!alsa_manager->ok()) {
+                  drop_alsa();
+                  reconnect_alsa();
+                }
+                return false;
+              });
+          }
+          return true;
+        });
+      // A reloaded config may name another card or mixer.
+      wloop.watch(worker.inbox(), [&, drop_alsa]() {
+          worker.take();
+          const AlsaSettings next = alsa_settings.load();
+          if (strcmp(next.card, mixer.card) != 0 || strcmp(next.mixer, mixer.mixer) != 0) {
+            mixer = next;
+            drop_alsa();
+            reconnect_alsa();
+          }
+          return false;
+        });
+    });
+  loop.watch(worker.fd(), [&]() {
+      worker.drain();
+      return show_snapshots(wifi_snapshot.load(), volume_snapshot.load());
+    });
+  loop.every_minute([&]() {
+      return status.update<Datetime>();
+    });
+
+  // Saving the config applies it.
+  ConfigWatch watch(path);
+  loop.watch(watch.fd(), [&]() {
+      if (!watch.changed()) {
+        return false;
       }
-    }
-    for (size_t j = (i >= N) ? (i - N + 3) : 3; j < i; ++j) {
-      static const size_t max_rx = (50<<20) / 8; // 50 megabits
-      static const size_t max_tx = (5<<20) / 8;  // 5 megabits
-      const int cur = j % N;
-      const int prev = (j - 1) % N;
-      auto secs = std::chrono::duration_cast<std::chrono::seconds>(t[cur] - t[prev]);
-      if (!secs.count()) {
-        continue;
+      std::string error;
+      if (!load_config(path, config(), error)) {
+        warnx("%s", error.c_str());
+        return false;
       }
-      const double rx_rate = (rx[cur] - rx[prev]) / double(secs.count());
-      const double tx_rate = (tx[cur] - tx[prev]) / double(secs.count());
-      const int rh = std::min(8, int(rx_rate < (100<<10)
-                                     ? (3 * rx_rate / (100<<10))
-                                     : (rx_rate < (1<<20)
-                                        ? (3 + (3 * rx_rate / (1<<20)))
-                                        : (6 + (2 * rx_rate / max_rx)))));
-      const int th = std::min(4, int(tx_rate < (10<<10)
-                                     ? (2 * tx_rate / (10<<10))
-                                     : (2 + (2 * tx_rate / max_tx))));
-      ss << Bar(0, 8 - rh, 1, rh, 0, true, GREEN)
-         << Bar(0, 9, 1, th, 1, true, RED);
-    }
-    return ss.str();
-  }
-};
+      apply_config();
+      worker.post();
+      const bool snapshots = show_snapshots(wifi_snapshot.load(), volume_snapshot.load());
+      return redraw() || snapshots;
+    });
 
-int main(void) {
-  Display *dpy;
-  if (!(dpy = XOpenDisplay(NULL))) {
-    err(1, "Cannot open display.");
+  // SIGUSR1 dumps the stats to stderr and the stats file.
+  const int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigfd < 0) {
+    err(1, "signalfd");
   }
+  loop.watch(sigfd, [&]() {
+      struct signalfd_siginfo si;
+      while (read(sigfd, &si, sizeof si) == sizeof si) {}
+      report(stderr, status, start_ns);
+      const std::string path = stats_path();
+      const std::string tmp = path + ".tmp";
+      if (FILE *f = fopen(tmp.c_str(), "w")) {
+        report(f, status, start_ns);
+        if (fclose(f) == 0) {
+          rename(tmp.c_str(), path.c_str());
+        }
+      }
+      return false;
+    });
 
-  AlsaManager alsa_manager;
-  Net n("wlp3s0");
+  // -s publishes every refresh for other tools; see dwmstatus.h.
+  std::unique_ptr<SharedSnapshot> snapshot;
+  if (shared) {
+    snapshot.reset(new SharedSnapshot);
+    snapshot->publish(status);
+  }
 
-  for (;;sleep(5)) {
-    std::stringstream ss;
-    Battery b;
-    Wifi w;
-    ss << Cpuinfo()
-       << Meminfo()
-       << n
-       << Temp();
-    if (w.present()) {
-      ss << w;
+  std::unique_ptr<Sink> sink = pending_sink.get();
+  for (;;) {
+    if (!loop.wait()) {
+      continue;
     }
-    if (b.present()) {
-      ss << b;
+    if (snapshot) {
+      snapshot->publish(status);
+    }
+    if (status.assemble()) {
+      sink->show(status.c_str());
     }
-    ss << ' ' << alsa_manager.get_volume()
-       << Datetime();
-    std::string s = ss.str();
-    XStoreName(dpy, DefaultRootWindow(dpy), s.c_str());
-    XSync(dpy, False);
   }
 
-  XCloseDisplay(dpy);
-
   return 0;
 }
+#endif  // DWMSTATUS_NO_MAIN
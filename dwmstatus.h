@@ -0,0 +1,112 @@
+// Layout of the shared memory snapshot that `dwmstatus -s' publishes, so
+// other tools can read what it samples instead of parsing /proc again,
+// and of the UDP snapshots `dwmstatus -a' sends to a `dwmstatus -l'.
+// C and C++; link with -lrt on older glibc.
+//
+//   struct dwmstatus_shm snap;
+//   if (dwmstatus_shm_read(shm, &snap) == 0) ...
+//
+// where shm is the segment named with DWMSTATUS_SHM_NAME_FMT below,
+// shm_open()ed read-only and mmap()ed PROT_READ for
+// sizeof(struct dwmstatus_shm) bytes.
+
+#ifndef DWMSTATUS_H
+#define DWMSTATUS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define DWMSTATUS_SHM_MAGIC 0x534d5744u  // "DWMS"
+#define DWMSTATUS_SHM_VERSION 1
+
+// snprintf(name, sizeof name, DWMSTATUS_SHM_NAME_FMT, getuid())
+#define DWMSTATUS_SHM_NAME_FMT "/dwmstatus-%u"
+
+#define DWMSTATUS_SHM_MAX_CPUS 1024
+#define DWMSTATUS_SHM_MAX_LINKS 8
+
+struct dwmstatus_shm_cpu {
+  uint8_t user, sys, io;  // percent of the last interval
+  uint8_t pad;
+};
+
+struct dwmstatus_shm_link {
+  int32_t ifindex;
+  uint32_t pad;
+  double rx, tx;  // bytes per second
+};
+
+struct dwmstatus_shm {
+  uint32_t magic;    // DWMSTATUS_SHM_MAGIC
+  uint32_t version;  // DWMSTATUS_SHM_VERSION
+  uint32_t size;     // sizeof(struct dwmstatus_shm) for this version
+  uint32_t seq;      // odd while the writer is updating; see below
+  uint64_t updated;  // CLOCK_MONOTONIC ns of the last update
+
+  // cpu[0] is the whole machine, cpu[1..ncpu] the individual cpus.
+  uint32_t ncpu;
+  uint32_t pad0;
+  struct dwmstatus_shm_cpu cpu[1 + DWMSTATUS_SHM_MAX_CPUS];
+
+  // kB, as in /proc/meminfo.
+  uint64_t mem_total, mem_free, mem_buffers, mem_cached;
+
+  uint32_t nlinks;
+  uint32_t pad1;
+  struct dwmstatus_shm_link link[DWMSTATUS_SHM_MAX_LINKS];
+
+  double temp;  // Celsius, aggregated as the status line shows it
+
+  int32_t battery_present;
+  int32_t battery_percent;
+  int32_t battery_minutes;  // to empty or to full
+  char battery_direction;   // '+' charging, '-' discharging, '=' full
+  char pad2[3];
+
+  int32_t volume;  // percent
+  int32_t muted;
+};
+
+// Copies a consistent snapshot into *out.  Returns 0 on success, -1 if
+// the segment isn't a version we understand, or if the writer kept
+// updating it across every attempt.
+static inline int dwmstatus_shm_read(const struct dwmstatus_shm *shm,
+                                     struct dwmstatus_shm *out) {
+  if (__atomic_load_n(&shm->magic, __ATOMIC_RELAXED) != DWMSTATUS_SHM_MAGIC ||
+      __atomic_load_n(&shm->version, __ATOMIC_RELAXED) != DWMSTATUS_SHM_VERSION) {
+    return -1;
+  }
+  for (int tries = 0; tries < 1000; ++tries) {
+    const uint32_t before = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      continue;
+    }
+    memcpy(out, shm, sizeof *out);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == before) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+#define DWMSTATUS_NODE_MAGIC 0x4e4d5744u  // "DWMN"
+#define DWMSTATUS_NODE_VERSION 1
+#define DWMSTATUS_NODE_PORT 7343
+
+// One datagram from an agent, exactly this size, integers in network
+// byte order.
+struct dwmstatus_node {
+  uint32_t magic;     // DWMSTATUS_NODE_MAGIC
+  uint16_t version;   // DWMSTATUS_NODE_VERSION
+  uint16_t interval;  // seconds until the agent sends again
+  uint32_t seq;
+  uint32_t load;      // one-minute load average, times 100
+  uint16_t ncpu;
+  uint8_t cpu, user, sys, io;  // percent of the last interval
+  uint8_t mem;                 // percent of memory in use
+  uint8_t pad;
+  char host[32];      // NUL-padded, not necessarily NUL-terminated
+};
+
+#endif  // DWMSTATUS_H